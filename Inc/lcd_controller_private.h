@@ -9,6 +9,8 @@
 #include "freeRTOS.h"
 #include "task.h"
 #include "queue.h"
+#include "semphr.h"
+#include "timers.h"
 
 /**********LCD Instructions***********/
 #define LCD_CLEAR 		0x1
@@ -17,6 +19,7 @@
 #define LCD_DISPLAY_CTRL	0x8
 #define LCD_SHIFT		0x10
 #define LCD_FUNC_SET		0x20
+#define LCD_CGRAM_SET		0x40
 #define LCD_CURSOR_SET		0x80
 
 /**********Instruction Flags**********/
@@ -45,8 +48,202 @@
 #define LCD_4BIT_MODE		0
 #define LCD_2LINE_MODE		0x8
 #define LCD_1LINE_MODE		0
+/*LCD_READ of instruction register*/
+#define LCD_BUSY_FLAG		0x80
+#define LCD_ADDR_MASK		0x7F
 /*************************************/
 
+/**********DDRAM Layout***************/
+#define LCD_LINE_LEN		40
+#define LCD_LINE2_ADDR		0x40
+#define LCD_DDRAM_SIZE		(2 * LCD_LINE_LEN)
+#define LCD_CGRAM_SIZE		64
+//part of each line that is visible on a 16x2 panel
+#define LCD_ROWS		2
+#define LCD_COLUMNS		16
+/*************************************/
+
+/**********Paging*******************/
+//whole pages that fit side by side in a DDRAM line
+#define LCD_PAGE_COUNT		(LCD_LINE_LEN / LCD_COLUMNS)
+/*************************************/
+
+/**********Animations***************/
+#ifndef LCD_MAX_ANIMATIONS
+#define LCD_MAX_ANIMATIONS	8
+#endif
+//period of the software timer driving every animation
+#ifndef LCD_ANIM_TICK_MS
+#define LCD_ANIM_TICK_MS	50
+#endif
+//progress bars use CGRAM characters base to base+3 for 1-4 filled pixel columns
+#ifndef LCD_ANIM_GLYPH_BASE
+#define LCD_ANIM_GLYPH_BASE	1
+#endif
+#define LCD_GLYPH_COLUMNS	5
+#define LCD_GLYPH_ROWS		8
+//solid block in the standard character ROM
+#define LCD_FULL_BLOCK		0xFF
+/*************************************/
+
+/**********Console Mode***************/
+#define LCD_CONSOLE_TAB		4
+#define LCD_CONSOLE_ESC		0x1B
+#define LCD_CONSOLE_MAX_PARAMS	2
+/*************************************/
+
+/**********ISR Posting****************/
+//number of independent ISR producers, each gets its own ring
+#ifndef LCD_ISR_SOURCES
+#define LCD_ISR_SOURCES		1
+#endif
+//frames per ring, must be a power of two
+#ifndef LCD_ISR_RING_SIZE
+#define LCD_ISR_RING_SIZE	32
+#endif
+//writer checks the rings at least this often while otherwise idle
+#ifndef LCD_ISR_POLL_MS
+#define LCD_ISR_POLL_MS		5
+#endif
+
+//rings are indexed by masking the free running head and tail
+#if (LCD_ISR_RING_SIZE & (LCD_ISR_RING_SIZE - 1)) != 0
+#error "LCD_ISR_RING_SIZE must be a power of two"
+#endif
+
+//writer is notified on index 2 once init is written and ISR posts can be drained
+#if configTASK_NOTIFICATION_ARRAY_ENTRIES < 3
+#error "LCD ISR posting requires configTASK_NOTIFICATION_ARRAY_ENTRIES >= 3"
+#endif
+/*************************************/
+
+/**********Transactions***************/
+//thread local storage slot holding each task's open transaction
+#ifndef LCD_TXN_TLS_INDEX
+#define LCD_TXN_TLS_INDEX	0
+#endif
+
+#if configNUM_THREAD_LOCAL_STORAGE_POINTERS <= LCD_TXN_TLS_INDEX
+#error "LCD transactions require configNUM_THREAD_LOCAL_STORAGE_POINTERS > LCD_TXN_TLS_INDEX"
+#endif
+
+//tasks committing a transaction, calibrating or syncing wait on this index
+//of their own notifications
+#ifndef LCD_REPLY_NOTIFY_INDEX
+#define LCD_REPLY_NOTIFY_INDEX	0
+#endif
+
+#if configTASK_NOTIFICATION_ARRAY_ENTRIES <= LCD_REPLY_NOTIFY_INDEX
+#error "LCD transactions require configTASK_NOTIFICATION_ARRAY_ENTRIES > LCD_REPLY_NOTIFY_INDEX"
+#endif
+
+//transactions begun while another is open are folded into it on commit
+#ifndef LCD_TXN_MAX_DEPTH
+#define LCD_TXN_MAX_DEPTH	4
+#endif
+
+#define LCD_TXN_FRAME_RS	0x100
+//markers around a folded transaction that restores the cursor, not written
+#define LCD_TXN_FRAME_SAVE	0x200
+#define LCD_TXN_FRAME_RESTORE	0x400
+//page number in bits 7-0, the writer shifts the display from wherever it is
+//to that page with the display off
+#define LCD_TXN_FRAME_PAGE	0x800
+//data frame skipped by the writer if the DDRAM cell already holds it
+#define LCD_TXN_FRAME_DIFF	0x2000
+/*************************************/
+
+/**********DDRAM Scrub****************/
+//cells read back per second during writer idle time, 0 disables scrubbing
+#ifndef LCD_SCRUB_CELLS_PER_SEC
+#define LCD_SCRUB_CELLS_PER_SEC	8
+#endif
+//most cells read back in a single idle slot
+#ifndef LCD_SCRUB_CELLS_PER_SLOT
+#define LCD_SCRUB_CELLS_PER_SLOT	2
+#endif
+/*************************************/
+
+/**********Timing Calibration*********/
+//timing used until calibrated, conservative enough for any clone
+#define LCD_DEFAULT_TIMING	{ 1000, 1000, 2000, 2000 }
+//added to the smallest passing value of each parameter
+#ifndef LCD_CALIB_MARGIN_PCT
+#define LCD_CALIB_MARGIN_PCT	50
+#endif
+//a timing must pass this many probes in a row
+#define LCD_CALIB_REPEATS	3
+//last columns of line 1, never shown unless the display is shifted
+#define LCD_CALIB_ADDR		0x24
+#define LCD_CALIB_CELLS		4
+//where the default LCD_SaveTiming keeps results
+#ifndef LCD_TIMING_BKPSRAM_OFFSET
+#define LCD_TIMING_BKPSRAM_OFFSET	0
+#endif
+#define LCD_TIMING_MAGIC	0x4C434454
+/*************************************/
+
+/**********Display Mirroring**********/
+//streams display state to the host when set to 1
+#ifndef LCD_USE_MIRROR
+#define LCD_USE_MIRROR		0
+#endif
+//up/down channel used by the default transport, SystemView uses channel 1
+#ifndef LCD_MIRROR_RTT_CHANNEL
+#define LCD_MIRROR_RTT_CHANNEL	2
+#endif
+#ifndef LCD_MIRROR_BYTES_PER_SEC
+#define LCD_MIRROR_BYTES_PER_SEC	2000
+#endif
+//deltas are sent at least this often while the queue is busy
+#define LCD_MIRROR_PERIOD_MS	20
+//full snapshot for hosts that connected without asking for one, 0 disables
+#ifndef LCD_MIRROR_SNAPSHOT_MS
+#define LCD_MIRROR_SNAPSHOT_MS	5000
+#endif
+#define LCD_MIRROR_RTT_BUF_SIZE	256
+
+/*record format, every record is LCD_MIRROR_SYNC, its type, then the fields below*/
+#define LCD_MIRROR_SYNC		0xA5
+//[addr][display ctrl][display shift][80 DDRAM bytes]
+#define LCD_MIRROR_SNAPSHOT	'S'
+//[first cell][cell count][cells], cells 0-39 are line 1 and 40-79 line 2
+#define LCD_MIRROR_DELTA	'D'
+//[addr]
+#define LCD_MIRROR_CURSOR	'C'
+//[display ctrl][display shift]
+#define LCD_MIRROR_MODE		'M'
+/*************************************/
+
+/**********Frame Capture**************/
+//records every frame the writer writes when set to 1
+#ifndef LCD_USE_CAPTURE
+#define LCD_USE_CAPTURE		0
+#endif
+//channel used when no RAM buffer is given, needs SEGGER_RTT_MAX_NUM_UP_BUFFERS > 3
+#ifndef LCD_CAPTURE_RTT_CHANNEL
+#define LCD_CAPTURE_RTT_CHANNEL	3
+#endif
+#define LCD_CAPTURE_RTT_BUF_SIZE	512
+
+/*log format, little endian*/
+//header: ['L']['C']['D']['C'][version][LCD_Mode_e][0][0]
+#define LCD_CAPTURE_VERSION	1
+#define LCD_CAPTURE_HEADER_SIZE	8
+//record: [us since previous record, 2 bytes, saturates][flags][data]
+#define LCD_CAPTURE_RECORD_SIZE	4
+#define LCD_CAPTURE_FLAG_DATA	0x1
+/*************************************/
+
+//cycle counter used for delays and timestamps, enabled by LCD_InitController
+//as the trace unit it belongs to is off after reset without a debugger
+#define LCD_DEMCR		( *(volatile uint32_t*)0xE000EDFC )
+#define LCD_DEMCR_TRCENA	(1 << 24)
+#define LCD_DWT_CTRL		( *(volatile uint32_t*)0xE0001000 )
+#define LCD_DWT_CYCCNTENA	(1 << 0)
+#define LCD_DWT_CYCCNT		( *(volatile uint32_t*)0xE0001004 )
+#define LCD_CYCLES_PER_US	( SystemCoreClock / 1000000 )
+
 #define LCD_UNDEF_GPIO_Port 	0
 #define LCD_UNDEF_Pin		0
 
@@ -96,6 +293,63 @@ typedef struct
 	LCD_Register_e dest_reg;
 } LCD_Frame_t;
 
+//expected controller state, updated by the writer as frames are written
+typedef struct
+{
+	uint8_t ddram[LCD_DDRAM_SIZE];
+	uint8_t cgram[LCD_CGRAM_SIZE];
+	uint8_t addr;
+	uint8_t addr_in_cgram;
+	uint8_t func_mode;
+	uint8_t entry_mode;
+	uint8_t display_ctrl;
+	//first DDRAM column shown on the left of the display
+	uint8_t display_shift;
+} LCD_Shadow_t;
+
+#if LCD_USE_MIRROR || LCD_USE_CAPTURE
+#include "SEGGER_RTT.h"
+#endif
+
+typedef enum {LCD_CMD_FRAME, LCD_CMD_TXN, LCD_CMD_CALIBRATE, LCD_CMD_SYNC} LCD_Command_e;
+
+typedef struct
+{
+	LCD_Command_e type;
+	LCD_Frame_t frame;
+	LCD_Transaction_t* txn;
+	//task waiting for the command to be done, NULL when nobody waits; it is
+	//woken on LCD_REPLY_NOTIFY_INDEX with the result as notification value
+	TaskHandle_t requester;
+	//when the command was queued, for latency stats
+	uint32_t post_time;
+	//where a sync puts the longest frame latency since the previous one
+	uint32_t* latency_max_us;
+} LCD_Command_t;
+
+typedef struct
+{
+	uint32_t magic;
+	LCD_Timing_t timing;
+	uint32_t checksum;
+} LCD_StoredTiming_t;
+
+typedef struct
+{
+	LCD_Frame_t frame;
+	uint32_t post_time;
+} LCD_ISRSlot_t;
+
+typedef struct
+{
+	LCD_ISRSlot_t slots[LCD_ISR_RING_SIZE];
+	//head is only written by the ISR, tail is only written by the writer task
+	volatile uint32_t head;
+	volatile uint32_t tail;
+	volatile uint32_t posts;
+	volatile uint32_t overflows;
+} LCD_ISRRing_t;
+
 TaskHandle_t LCD_init_task;
 TaskHandle_t LCD_write_task;
 QueueHandle_t LCD_write_queue;
@@ -103,15 +357,153 @@ QueueHandle_t LCD_write_queue;
 uint8_t cursor_showing;
 uint8_t cursor_blinking;
 
+//page whose DDRAM columns are shown, set by the display shift; changed only
+//once the frames that change it have been sent or their transaction committed
+uint8_t visible_page;
+//counts clears so cached display contents elsewhere can be invalidated
+volatile uint8_t display_clears;
+//held while visible_page or page_txn is in use, pages can be used from any task
+SemaphoreHandle_t page_lock;
+LCD_Transaction_t page_txn;
+
+//only upper nibble is written in first part of init sequence in 4-bit mode
+uint8_t lower_nibble_writable;
+
+LCD_ISRRing_t LCD_isr_rings[LCD_ISR_SOURCES];
+LCD_Stats_t LCD_stats;
+
+LCD_Shadow_t LCD_shadow;
+
+LCD_Timing_t LCD_timing;
+//timing came from storage and has not been checked against this panel yet
+uint8_t timing_unverified;
+//time the previous write still needs before the LCD accepts another
+uint32_t exec_wait_us;
+
+//longest frame latency since the last sync, only touched by the writer
+uint32_t sync_latency_max_us;
+
+typedef struct
+{
+	volatile uint8_t active;
+	LCD_Mode_e mode;
+	//RAM log, NULL when streaming over RTT
+	uint8_t* buf;
+	uint32_t size;
+	uint32_t len;
+	uint32_t last_time;
+	uint32_t dropped;
+} LCD_Capture_t;
+
+LCD_Capture_t LCD_capture;
+
+//what the host has been sent
+typedef struct
+{
+	uint8_t ddram[LCD_DDRAM_SIZE];
+	uint8_t addr;
+	uint8_t display_ctrl;
+	uint8_t display_shift;
+	uint8_t resync;
+	uint32_t credit;
+	TickType_t last_tick;
+	TickType_t last_flush;
+	TickType_t last_snapshot;
+} LCD_Mirror_t;
+
+LCD_Mirror_t LCD_mirror;
+
+typedef enum {LCD_ESC_NONE, LCD_ESC_START, LCD_ESC_CSI} LCD_EscState_e;
+
+typedef struct
+{
+	//what the console last put on the display
+	char screen[LCD_ROWS][LCD_COLUMNS];
+	uint8_t active;
+	uint8_t row;
+	//reaches LCD_COLUMNS after the last column, wraps on the next character
+	uint8_t column;
+	LCD_EscState_e esc_state;
+	uint8_t esc_params[LCD_CONSOLE_MAX_PARAMS];
+	uint8_t esc_param_count;
+	//display_clears when screen was last known to match the display
+	uint8_t clears_seen;
+	LCD_Transaction_t txn;
+} LCD_Console_t;
+
+LCD_Console_t LCD_console;
+
+//only touched from the timer task, so no locking is needed
+LCD_Animation_t* LCD_animations[LCD_MAX_ANIMATIONS];
+TimerHandle_t LCD_anim_timer;
+LCD_Transaction_t anim_txn;
+uint8_t anim_glyphs_loaded;
+//animation that goes first in the next tick, moved on when one does not fit
+uint8_t anim_first;
+
+uint16_t scrub_cells_per_sec;
+uint32_t scrub_credit;
+TickType_t scrub_last_tick;
+uint8_t scrub_index;
+//one bit per cell a reset did not fix, cleared once it reads back fine
+uint8_t scrub_unfixed[(LCD_DDRAM_SIZE + 7) / 8];
+
 #ifdef LCD_SPI_PINS_DEFINED
 extern SPI_HandleTypeDef hspi2;
 #endif
 
 void LCD_WriteHandler(void* use_4bit_mode);
+void LCD_WriteFrame(LCD_Mode_e LCD_mode, LCD_Frame_t* frame, uint8_t busyflag_available);
+void LCD_WriteTransaction(LCD_Mode_e LCD_mode, LCD_Transaction_t* txn);
+void LCD_DrainISRRings(LCD_Mode_e LCD_mode);
+uint8_t LCD_QueueFrame(const LCD_Frame_t* frame);
+uint8_t LCD_SendTransaction(LCD_Transaction_t* txn, TaskHandle_t requester, TickType_t ticks_to_wait);
+LCD_ISRSlot_t* LCD_ReserveFromISR(uint8_t isr_source, uint32_t count);
+void LCD_PublishFromISR(uint8_t isr_source, uint32_t count);
 void LCD_WritePins(LCD_Mode_e LCD_mode, LCD_Register_e dest_reg, LCD_Operation_e operation, uint8_t data);
 void LCD_8Bit_WritePins(LCD_Register_e dest_reg, LCD_Operation_e operation, uint8_t data);
 void LCD_4Bit_WritePins(LCD_Register_e dest_reg, LCD_Operation_e operation, uint8_t data);
 void LCD_SPI_WritePins(LCD_Register_e dest_reg, LCD_Operation_e operation, uint8_t data);
+uint8_t LCD_ReadPins(LCD_Mode_e LCD_mode, LCD_Register_e src_reg);
+uint8_t LCD_8Bit_ReadPins(LCD_Register_e src_reg);
+uint8_t LCD_4Bit_ReadPins(LCD_Register_e src_reg);
+void LCD_SetDataPinsMode(uint8_t first_pin, uint32_t gpio_mode);
+void LCD_ShadowApply(const LCD_Frame_t* frame);
+uint8_t LCD_ShadowIndex(uint8_t addr);
+uint8_t LCD_NextAddr(uint8_t addr, uint8_t increment);
+void LCD_WriteAddr(LCD_Mode_e LCD_mode, uint8_t addr, uint8_t in_cgram);
+void LCD_WritePageFlip(LCD_Mode_e LCD_mode, uint8_t page);
+void LCD_WriteDirect(LCD_Mode_e LCD_mode, LCD_Register_e dest_reg, uint8_t data);
+void LCD_WaitExec(void);
+void LCD_SetExecWait(LCD_Register_e dest_reg, uint8_t data);
+void LCD_DelayUs(uint32_t us);
+uint8_t LCD_Calibrate(LCD_Mode_e LCD_mode);
+uint8_t LCD_CalibProbe(LCD_Mode_e LCD_mode, uint8_t use_slow_instruction);
+void LCD_VerifyTiming(LCD_Mode_e LCD_mode);
+LCD_StoredTiming_t* LCD_EnableTimingStore(void);
+uint32_t LCD_TimingChecksum(const LCD_Timing_t* timing);
+void LCD_MirrorInit(void);
+void LCD_MirrorFlush(uint8_t force);
+uint8_t LCD_MirrorSend(const uint8_t* record, uint16_t len);
+uint8_t LCD_MirrorTransmit(const uint8_t* data, uint16_t len);
+uint8_t LCD_MirrorConnected(void);
+void LCD_ScrubIdle(LCD_Mode_e LCD_mode);
+void LCD_CaptureFrame(const LCD_Frame_t* frame);
+void LCD_CaptureWrite(const uint8_t* bytes, uint32_t len);
+uint32_t LCD_WaitForWriter(uint32_t* latency_max_us);
+uint32_t LCD_AwaitWriter(void);
+uint8_t LCD_VisibleAddr(uint8_t page, uint8_t row, uint8_t column);
+void LCD_NotePageChange(uint8_t page, uint8_t cleared);
+uint8_t LCD_CurrentPage(void);
+void LCD_AnimTick(TimerHandle_t timer);
+void LCD_AnimRegister(void* anim, uint32_t add);
+void LCD_AnimRender(LCD_Animation_t* anim, TickType_t now, uint8_t* cells);
+void LCD_AnimLoadGlyphs(void);
+void LCD_ConsolePutChar(char screen[LCD_ROWS][LCD_COLUMNS], char c);
+void LCD_ConsoleEscape(char screen[LCD_ROWS][LCD_COLUMNS], char c);
+void LCD_ConsoleNewLine(char screen[LCD_ROWS][LCD_COLUMNS]);
+uint8_t LCD_ScrubCell(LCD_Mode_e LCD_mode, uint8_t index);
+void LCD_RecoverController(LCD_Mode_e LCD_mode);
 void LCD_WriteInitSeq(uint8_t use_4bit_mode);
 void LCD_SetFuncMode(uint8_t data_length_flag, uint8_t line_num_flag, uint8_t font_type_flag);
 void LCD_SetEntryMode(uint8_t shift_dir_flag, uint8_t shift_mode_flag);
@@ -2,6 +2,108 @@
 
 typedef enum {LCD_4BIT, LCD_8BIT, LCD_SPI} LCD_Mode_e;
 
+//most frames a single transaction can hold
+#ifndef LCD_TXN_MAX_FRAMES
+#define LCD_TXN_MAX_FRAMES	48
+#endif
+
+typedef struct LCD_Transaction_s
+{
+	//contents are private to the driver
+	//register select and markers in bits 15-8 and data in bits 7-0 of each frame
+	uint16_t frames[LCD_TXN_MAX_FRAMES];
+	uint8_t count;
+	uint8_t overflowed;
+	//address counter is put back after the frames when set
+	uint8_t restore_cursor;
+	//set while the writer has the transaction, only driver internal
+	//transactions are handed over without waiting for the writer
+	volatile uint8_t pending;
+	//transaction that was open when this one began, its frames go there
+	struct LCD_Transaction_s* outer;
+	uint8_t depth;
+	//page shown and clears made once committed, page count when unchanged
+	uint8_t page_after;
+	uint8_t clears;
+} LCD_Transaction_t;
+
+//widest region a single animation can cover
+#define LCD_ANIM_MAX_WIDTH	16
+
+typedef enum {LCD_ANIM_PROGRESS, LCD_ANIM_SPINNER, LCD_ANIM_BLINK} LCD_AnimType_e;
+
+typedef struct
+{
+	LCD_AnimType_e type;
+	//region, skipped while its page is not the one shown
+	uint8_t page;
+	uint8_t row;
+	uint8_t column;
+	//cells covered by a progress bar, spinners always cover one
+	uint8_t width;
+	//time per spinner frame, or time a blinking field stays on and off
+	uint16_t period_ms;
+	//spinner frames, one character each, or text of a blinking field
+	const char* text;
+	//progress bar fill, from 0 to max
+	volatile uint16_t value;
+	uint16_t max;
+
+	//private to the driver
+	volatile uint8_t registered;
+	volatile uint8_t register_pending;
+} LCD_Animation_t;
+
+typedef struct
+{
+	//data setup time and enable pulse high width
+	uint32_t enable_pulse_us;
+	//data hold time and enable pulse low width
+	uint32_t hold_us;
+	//wait after any write other than clear and home
+	uint32_t exec_us;
+	//wait after clear and home
+	uint32_t clear_exec_us;
+} LCD_Timing_t;
+
+typedef struct
+{
+	//posts accepted from ISRs and posts dropped because the ring was full
+	uint32_t isr_posts;
+	uint32_t isr_overflows;
+	//time from an ISR post to its frame being written to the LCD
+	uint32_t isr_latency_last_us;
+	uint32_t isr_latency_max_us;
+	//DDRAM cells read back, cells found corrupted, controller resets recovered
+	uint32_t scrub_cells_checked;
+	uint32_t scrub_cells_repaired;
+	uint32_t scrub_resets;
+	//checks of a cell that stayed wrong after a reset, which is not repeated
+	//for that cell until it reads back correctly
+	uint32_t scrub_repair_failures;
+	//display mirroring bytes and records sent, records dropped by the budget
+	uint32_t mirror_bytes;
+	uint32_t mirror_records;
+	uint32_t mirror_drops;
+	//longest time spent building and sending one mirror update
+	uint32_t mirror_flush_max_us;
+	//frames written from the queue and time from queueing to being written
+	uint32_t frames_written;
+	uint32_t frame_latency_last_us;
+	uint32_t frame_latency_max_us;
+} LCD_Stats_t;
+
+typedef struct
+{
+	uint32_t frames;
+	//from first frame queued to last frame written
+	uint32_t elapsed_us;
+	uint32_t frames_per_sec;
+	uint32_t latency_max_us;
+	//visible contents once the replay has been written
+	char screen[2][17];
+} LCD_ReplayReport_t;
+
 void LCD_InitController(LCD_Mode_e LCD_mode);
 void LCD_TurnOnDisplay(void);
 void LCD_TurnOffDisplay(void);
@@ -10,3 +112,70 @@ void LCD_ClearDisplay(void);
 void LCD_SetCursorMode(uint8_t show_cursor, uint8_t blink_cursor);
 void LCD_SetCursorPos(uint8_t row, uint8_t column);
 void LCD_SetCursorHome(void);
+
+//ISR-safe variants, never block and never enter a critical section
+//each isr_source must only be used by one ISR (or ISRs of equal priority)
+//a post that does not fit in its ring is dropped whole and pdFALSE is returned
+uint8_t LCD_WriteTextFromISR(uint8_t isr_source, const char* text);
+uint8_t LCD_SetCursorPosFromISR(uint8_t isr_source, uint8_t row, uint8_t column);
+
+void LCD_GetStats(LCD_Stats_t* stats);
+
+//idle time DDRAM read back budget, not available in SPI mode
+void LCD_SetScrubBudget(uint16_t cells_per_sec);
+
+//operations called by a task between begin and commit are collected in txn
+//and written to the LCD contiguously, costing a single queue send on commit
+//commit returns once the writer has written every frame, so txn can live on
+//the caller's stack; the task is woken on notification LCD_REPLY_NOTIFY_INDEX
+//commit returns pdFALSE and writes nothing if txn ran out of room
+//a transaction begun while another is open is nested, its commit appends
+//its frames to the outer one, which fails if they do not fit
+void LCD_BeginTransaction(LCD_Transaction_t* txn);
+uint8_t LCD_CommitTransaction(LCD_Transaction_t* txn);
+
+//searches for the shortest timing the panel reliably accepts using DDRAM
+//read back, adds a margin and saves it with LCD_SaveTiming
+//blocks until done, returns pdFALSE in SPI mode or if no timing verified
+uint8_t LCD_CalibrateTiming(void);
+void LCD_GetTiming(LCD_Timing_t* timing);
+void LCD_SetTiming(const LCD_Timing_t* timing);
+
+//weak, default keeps timing in backup SRAM; override to use flash or EEPROM
+uint8_t LCD_LoadTiming(LCD_Timing_t* timing);
+void LCD_SaveTiming(const LCD_Timing_t* timing);
+
+//console mode for a single task, wraps at the end of a line and scrolls up
+//after the last one, rewriting only the cells that change
+//handles \n, \r, \b, \t, \f and the escape sequences
+//ESC[<row>;<col>H (1-based), ESC[K (clear to end of line), ESC[2J (clear)
+void LCD_ConsoleWrite(const char* text);
+void LCD_ConsoleClear(void);
+
+//pages 0 and 1 are kept in separate DDRAM columns, writing a page that is
+//not shown happens off screen and showing a page only shifts the display
+//cursor positions are relative to the page shown, clearing drops every page
+//rewriting a page only writes cells that differ from what DDRAM holds
+//when the writer gets to them
+uint8_t LCD_WritePage(uint8_t page, const char* line1, const char* line2);
+uint8_t LCD_ShowPage(uint8_t page);
+
+//animations are run by one software timer and every cell they change in a
+//tick is written in one transaction; anim must stay valid until removed
+//add returns pdFALSE if anim does not fit on the display, a spinner or
+//blinking field has no text or a period under one tick, or the table is full
+uint8_t LCD_AddAnimation(LCD_Animation_t* anim);
+void LCD_RemoveAnimation(LCD_Animation_t* anim);
+void LCD_SetProgress(LCD_Animation_t* anim, uint16_t value);
+
+//records every frame the writer writes, with its time, to buf, or to RTT
+//when buf is NULL; only available when built with LCD_USE_CAPTURE set to 1
+void LCD_StartCapture(uint8_t* buf, uint32_t size);
+//returns length of the RAM log
+uint32_t LCD_StopCapture(void);
+//feeds a log back through the same path as the public operations, with its
+//original gaps when timed is set, and reports on how it was written
+uint8_t LCD_ReplayCapture(const uint8_t* log, uint32_t len, uint8_t timed, LCD_ReplayReport_t* report);
+
+//visible contents of both lines, each line must hold 17 characters
+void LCD_GetScreen(char* line1, char* line2);
@@ -5,6 +5,34 @@
 void LCD_InitController(LCD_Mode_e LCD_mode)
 {
 	cursor_showing = cursor_blinking = pdFALSE;
+	lower_nibble_writable = pdFALSE;
+	LCD_capture.mode = LCD_mode;
+
+	//every delay and latency stat spins on the cycle counter
+	LCD_DEMCR |= LCD_DEMCR_TRCENA;
+	LCD_DWT_CTRL |= LCD_DWT_CYCCNTENA;
+
+	//matches controller state after the clear below
+	memset(&LCD_shadow, 0, sizeof(LCD_shadow));
+	memset(LCD_shadow.ddram, ' ', sizeof(LCD_shadow.ddram));
+	LCD_shadow.entry_mode = LCD_ENTRY_MODE | LCD_AUTO_INCREMENT;
+	LCD_shadow.display_ctrl = LCD_DISPLAY_CTRL;
+
+	//start from timing tuned on a previous boot if there is one, the panel
+	//may have been swapped since so the writer checks it once init is done
+	timing_unverified = LCD_LoadTiming(&LCD_timing);
+	if(!timing_unverified)
+		LCD_timing = (LCD_Timing_t)LCD_DEFAULT_TIMING;
+	exec_wait_us = 0;
+
+#if LCD_USE_MIRROR
+	LCD_MirrorInit();
+#endif
+
+	scrub_cells_per_sec = LCD_SCRUB_CELLS_PER_SEC;
+	scrub_credit = scrub_index = 0;
+	memset(scrub_unfixed, 0, sizeof(scrub_unfixed));
+	scrub_last_tick = xTaskGetTickCount();
 
 	LCD_init_task = xTaskGetCurrentTaskHandle();
 
@@ -19,7 +47,10 @@ void LCD_InitController(LCD_Mode_e LCD_mode)
 	}
 
 	//data to write to LCD
-	LCD_write_queue = xQueueCreate(40, sizeof(LCD_Frame_t));
+	LCD_write_queue = xQueueCreate(40, sizeof(LCD_Command_t));
+
+	//page state is shared by every task that writes or shows pages
+	page_lock = xSemaphoreCreateMutex();
 
 	//writes queued data to LCD
 	xTaskCreate(LCD_WriteHandler, "LCD Write", 200,
@@ -37,22 +68,45 @@ void LCD_InitController(LCD_Mode_e LCD_mode)
 	LCD_SetEntryMode(LCD_AUTO_INCREMENT, LCD_AUTO_SHIFT_CURSOR);
 
 	LCD_TurnOnDisplay();
+
+	//ISR posts can be written once everything above has been
+	xTaskNotifyGiveIndexed(LCD_write_task, 2);
 }
 
 void LCD_WriteHandler(void* LCD_mode)
 {
 	//busy flag is not available for first part of init sequence
 	uint8_t busyflag_available = pdFALSE;
-	//only upper nibble is written in first part of init sequence in 4-bit mode
-	uint8_t lower_nibble_writable = pdFALSE;
-	//queue must be fully processed before either flag is set
+	//ISR rings are only drained once the init sequence has been written
+	uint8_t isr_rings_drainable = pdFALSE;
+	//queue must be fully processed before any flag is set
 	uint8_t awaiting_empty_queue = pdFALSE;
 
-	LCD_Frame_t frame;
+	LCD_Command_t command;
 
 	while(1)
 	{
-		xQueueReceive(LCD_write_queue, &frame, portMAX_DELAY);
+		if(xQueueReceive(LCD_write_queue, &command, pdMS_TO_TICKS(LCD_ISR_POLL_MS)) != pdTRUE)
+		{
+			//queue is already empty if init sequence was fully written while waiting
+			if(!isr_rings_drainable && !awaiting_empty_queue && busyflag_available &&
+					ulTaskNotifyTakeIndexed(2, pdTRUE, 0) == 1)
+			{
+				isr_rings_drainable = pdTRUE;
+				LCD_VerifyTiming((uint32_t)LCD_mode);
+			}
+
+			//idle, only ISR posts can be pending
+			if(isr_rings_drainable)
+			{
+				LCD_DrainISRRings((uint32_t)LCD_mode);
+#if LCD_USE_MIRROR
+				LCD_MirrorFlush(pdTRUE);
+#endif
+				LCD_ScrubIdle((uint32_t)LCD_mode);
+			}
+			continue;
+		}
 
 		if(!awaiting_empty_queue)
 		{
@@ -64,35 +118,658 @@ void LCD_WriteHandler(void* LCD_mode)
 			else if((uint32_t)LCD_mode == LCD_4BIT && !lower_nibble_writable &&
 					ulTaskNotifyTakeIndexed(1, pdTRUE, 0) == 1)
 				awaiting_empty_queue = pdTRUE;
+
+			//init task notifies index 2 when the init sequence is fully queued
+			else if(!isr_rings_drainable && ulTaskNotifyTakeIndexed(2, pdTRUE, 0) == 1)
+				awaiting_empty_queue = pdTRUE;
 		}
 
-		//Do not bother actually checking busy flag for now as it is no better
-		//than just using a delay until shorter delays are implemented
-		if(busyflag_available)
-			HAL_Delay(2);
+		//transactions and calibration are only requested by the application after init
+		switch(command.type)
+		{
+		case LCD_CMD_FRAME:
+			LCD_WriteFrame((uint32_t)LCD_mode, &command.frame, busyflag_available);
+			LCD_stats.frames_written++;
+			break;
+		case LCD_CMD_TXN:
+			LCD_stats.frames_written += command.txn->count;
+			LCD_WriteTransaction((uint32_t)LCD_mode, command.txn);
+			if(command.requester != NULL)
+				xTaskNotifyIndexed(command.requester, LCD_REPLY_NOTIFY_INDEX, 0, eSetValueWithOverwrite);
+			break;
+		case LCD_CMD_CALIBRATE:
+			xTaskNotifyIndexed(command.requester, LCD_REPLY_NOTIFY_INDEX,
+					LCD_Calibrate((uint32_t)LCD_mode), eSetValueWithOverwrite);
+			break;
+		case LCD_CMD_SYNC:
+			//each sync starts a new latency window for whoever waits next
+			if(command.latency_max_us != NULL)
+				*command.latency_max_us = sync_latency_max_us;
+			sync_latency_max_us = 0;
+			//caller is told when everything before the sync was done, not when it woke
+			xTaskNotifyIndexed(command.requester, LCD_REPLY_NOTIFY_INDEX,
+					LCD_DWT_CYCCNT, eSetValueWithOverwrite);
+			break;
+		}
 
-		LCD_WritePins((uint32_t)LCD_mode, frame.dest_reg, LCD_WRITE, frame.data);
+		if(command.type == LCD_CMD_FRAME || command.type == LCD_CMD_TXN)
+		{
+			uint32_t latency = (LCD_DWT_CYCCNT - command.post_time) / LCD_CYCLES_PER_US;
+			LCD_stats.frame_latency_last_us = latency;
+			if(latency > LCD_stats.frame_latency_max_us)
+				LCD_stats.frame_latency_max_us = latency;
+			if(latency > sync_latency_max_us)
+				sync_latency_max_us = latency;
+		}
 
-		if(awaiting_empty_queue)
+		if(awaiting_empty_queue && uxQueueMessagesWaiting(LCD_write_queue) == 0)
 		{
-			if(!busyflag_available && uxQueueMessagesWaiting(LCD_write_queue) == 0)
+			awaiting_empty_queue = pdFALSE;
+
+			if(!busyflag_available)
 			{
 				//queue has been processed to point where busy flag is available
 				busyflag_available = pdTRUE;
-				awaiting_empty_queue = pdFALSE;
 				xTaskNotify(LCD_init_task, 0, eNoAction);
 			}
 
-			else if((uint32_t)LCD_mode == LCD_4BIT && !lower_nibble_writable &&
-					uxQueueMessagesWaiting(LCD_write_queue) == 0)
+			else if((uint32_t)LCD_mode == LCD_4BIT && !lower_nibble_writable)
 			{
 				//queue has been processed to point where lower nibble is writable
 				lower_nibble_writable = pdTRUE;
-				awaiting_empty_queue = pdFALSE;
 				xTaskNotify(LCD_init_task, 0, eNoAction);
 			}
+
+			//init task does not wait on this one
+			else
+			{
+				isr_rings_drainable = pdTRUE;
+				LCD_VerifyTiming((uint32_t)LCD_mode);
+			}
+		}
+
+		//ISR posts are written between queued frames so they are not starved
+		if(isr_rings_drainable)
+		{
+			LCD_DrainISRRings((uint32_t)LCD_mode);
+#if LCD_USE_MIRROR
+			//changes are batched up until the queue runs dry
+			LCD_MirrorFlush(uxQueueMessagesWaiting(LCD_write_queue) == 0);
+#endif
+		}
+	}
+}
+
+void LCD_WriteFrame(LCD_Mode_e LCD_mode, LCD_Frame_t* frame, uint8_t busyflag_available)
+{
+	//busy flag is not polled, waiting out the calibrated execution time of
+	//the previous frame is cheaper than a read and also works over SPI
+	if(busyflag_available)
+		LCD_WaitExec();
+
+	LCD_WritePins(LCD_mode, frame->dest_reg, LCD_WRITE, frame->data);
+	LCD_SetExecWait(frame->dest_reg, frame->data);
+
+	LCD_ShadowApply(frame);
+
+#if LCD_USE_CAPTURE
+	if(LCD_capture.active)
+		LCD_CaptureFrame(frame);
+#endif
+}
+
+void LCD_WriteDirect(LCD_Mode_e LCD_mode, LCD_Register_e dest_reg, uint8_t data)
+{
+	//bypasses the shadow, used to bring the LCD back in line with it
+	LCD_WaitExec();
+
+	LCD_WritePins(LCD_mode, dest_reg, LCD_WRITE, data);
+	LCD_SetExecWait(dest_reg, data);
+}
+
+void LCD_WaitExec(void)
+{
+	LCD_DelayUs(exec_wait_us);
+	exec_wait_us = 0;
+}
+
+void LCD_SetExecWait(LCD_Register_e dest_reg, uint8_t data)
+{
+	//clear and home take far longer than every other instruction
+	if(dest_reg == LCD_REG_INSTRUCTION && data != 0 && data <= (LCD_HOME | LCD_CLEAR))
+		exec_wait_us = LCD_timing.clear_exec_us;
+	else
+		exec_wait_us = LCD_timing.exec_us;
+}
+
+void LCD_DelayUs(uint32_t us)
+{
+	//cycle counter gives sub-tick delays that HAL_Delay cannot
+	uint32_t start = LCD_DWT_CYCCNT;
+	uint32_t cycles = us * LCD_CYCLES_PER_US;
+
+	while(LCD_DWT_CYCCNT - start < cycles);
+}
+
+void LCD_ShadowApply(const LCD_Frame_t* frame)
+{
+	uint8_t data = frame->data;
+	uint8_t increment = LCD_shadow.entry_mode & LCD_AUTO_INCREMENT;
+
+	if(frame->dest_reg == LCD_REG_DATA)
+	{
+		if(LCD_shadow.addr_in_cgram)
+		{
+			LCD_shadow.cgram[LCD_shadow.addr] = data;
+			LCD_shadow.addr = (LCD_shadow.addr + (increment ? 1 : -1)) & (LCD_CGRAM_SIZE - 1);
+			return;
+		}
+
+		LCD_shadow.ddram[LCD_ShadowIndex(LCD_shadow.addr)] = data;
+		LCD_shadow.addr = LCD_NextAddr(LCD_shadow.addr, increment);
+
+		//display moves along with the cursor when auto shift is on
+		if(LCD_shadow.entry_mode & LCD_AUTO_SHIFT_DISPLAY)
+			LCD_shadow.display_shift = (LCD_shadow.display_shift +
+					(increment ? 1 : LCD_LINE_LEN - 1)) % LCD_LINE_LEN;
+		return;
+	}
+
+	//highest set bit identifies the instruction
+	if(data & LCD_CURSOR_SET)
+	{
+		LCD_shadow.addr = data & LCD_ADDR_MASK;
+		LCD_shadow.addr_in_cgram = pdFALSE;
+	}
+	else if(data & LCD_CGRAM_SET)
+	{
+		LCD_shadow.addr = data & (LCD_CGRAM_SIZE - 1);
+		LCD_shadow.addr_in_cgram = pdTRUE;
+	}
+	else if(data & LCD_FUNC_SET)
+		LCD_shadow.func_mode = data;
+	else if(data & LCD_SHIFT)
+	{
+		//shifting the display right brings earlier columns into view
+		if(data & LCD_SHIFT_DISPLAY)
+			LCD_shadow.display_shift = (LCD_shadow.display_shift +
+					((data & LCD_SHIFT_RIGHT) ? LCD_LINE_LEN - 1 : 1)) % LCD_LINE_LEN;
+		else
+			LCD_shadow.addr = LCD_NextAddr(LCD_shadow.addr, data & LCD_SHIFT_RIGHT);
+	}
+	else if(data & LCD_DISPLAY_CTRL)
+		LCD_shadow.display_ctrl = data;
+	else if(data & LCD_ENTRY_MODE)
+		LCD_shadow.entry_mode = data;
+	else if(data & (LCD_HOME | LCD_CLEAR))
+	{
+		if(data & LCD_CLEAR)
+		{
+			//clear also sets entry mode back to increment
+			memset(LCD_shadow.ddram, ' ', sizeof(LCD_shadow.ddram));
+			LCD_shadow.entry_mode |= LCD_AUTO_INCREMENT;
+		}
+
+		LCD_shadow.addr = 0;
+		LCD_shadow.addr_in_cgram = pdFALSE;
+		LCD_shadow.display_shift = 0;
+	}
+}
+
+uint8_t LCD_ShadowIndex(uint8_t addr)
+{
+	//line 1 is 0x00-0x27, line 2 is 0x40-0x67
+	return ((addr & LCD_LINE2_ADDR) ? LCD_LINE_LEN : 0) + (addr & 0x3F) % LCD_LINE_LEN;
+}
+
+uint8_t LCD_NextAddr(uint8_t addr, uint8_t increment)
+{
+	//address counter wraps between the end of one line and start of the other
+	if(increment)
+	{
+		if(addr == LCD_LINE_LEN - 1)
+			return LCD_LINE2_ADDR;
+		if(addr == LCD_LINE2_ADDR + LCD_LINE_LEN - 1)
+			return 0;
+		return addr + 1;
+	}
+
+	if(addr == 0)
+		return LCD_LINE2_ADDR + LCD_LINE_LEN - 1;
+	if(addr == LCD_LINE2_ADDR)
+		return LCD_LINE_LEN - 1;
+	return addr - 1;
+}
+
+#if LCD_USE_MIRROR
+void LCD_MirrorInit(void)
+{
+	static uint8_t up_buffer[LCD_MIRROR_RTT_BUF_SIZE];
+	static uint8_t down_buffer[16];
+
+	SEGGER_RTT_ConfigUpBuffer(LCD_MIRROR_RTT_CHANNEL, "LCD Mirror",
+			up_buffer, sizeof(up_buffer), SEGGER_RTT_MODE_NO_BLOCK_SKIP);
+	SEGGER_RTT_ConfigDownBuffer(LCD_MIRROR_RTT_CHANNEL, "LCD Mirror",
+			down_buffer, sizeof(down_buffer), SEGGER_RTT_MODE_NO_BLOCK_SKIP);
+
+	memset(&LCD_mirror, 0, sizeof(LCD_mirror));
+	LCD_mirror.resync = pdTRUE;
+	LCD_mirror.last_tick = LCD_mirror.last_flush = xTaskGetTickCount();
+}
+
+void LCD_MirrorFlush(uint8_t force)
+{
+	TickType_t now = xTaskGetTickCount();
+
+	if(!force && now - LCD_mirror.last_flush < pdMS_TO_TICKS(LCD_MIRROR_PERIOD_MS))
+		return;
+
+	uint32_t start = LCD_DWT_CYCCNT;
+	//only the writer flushes, kept off its stack along with the RTT call chain
+	static uint8_t record[4 + LCD_DDRAM_SIZE];
+
+	LCD_mirror.last_flush = now;
+
+	//budget accrues in bytes * ticks so no fractions are needed
+	LCD_mirror.credit += (now - LCD_mirror.last_tick) * LCD_MIRROR_BYTES_PER_SEC;
+	LCD_mirror.last_tick = now;
+	if(LCD_mirror.credit > LCD_MIRROR_BYTES_PER_SEC * configTICK_RATE_HZ)
+		LCD_mirror.credit = LCD_MIRROR_BYTES_PER_SEC * configTICK_RATE_HZ;
+
+	if(LCD_MirrorConnected() || (LCD_MIRROR_SNAPSHOT_MS &&
+			now - LCD_mirror.last_snapshot >= pdMS_TO_TICKS(LCD_MIRROR_SNAPSHOT_MS)))
+		LCD_mirror.resync = pdTRUE;
+
+	if(LCD_mirror.resync)
+	{
+		record[0] = LCD_MIRROR_SNAPSHOT;
+		record[1] = LCD_shadow.addr;
+		record[2] = LCD_shadow.display_ctrl;
+		record[3] = LCD_shadow.display_shift;
+		memcpy(&record[4], LCD_shadow.ddram, LCD_DDRAM_SIZE);
+
+		//retried on the next flush if the budget or link could not take it
+		if(!LCD_MirrorSend(record, 4 + LCD_DDRAM_SIZE))
+			return;
+
+		memcpy(LCD_mirror.ddram, LCD_shadow.ddram, LCD_DDRAM_SIZE);
+		LCD_mirror.addr = LCD_shadow.addr;
+		LCD_mirror.display_ctrl = LCD_shadow.display_ctrl;
+		LCD_mirror.display_shift = LCD_shadow.display_shift;
+		LCD_mirror.last_snapshot = now;
+		LCD_mirror.resync = pdFALSE;
+	}
+
+	//each run of changed cells becomes one delta record
+	for(uint8_t i=0; i < LCD_DDRAM_SIZE; i++)
+	{
+		if(LCD_mirror.ddram[i] == LCD_shadow.ddram[i])
+			continue;
+
+		uint8_t len = 1;
+		//runs stop at the end of a line so each one stays on a single row
+		while((i + len) % LCD_LINE_LEN != 0 && LCD_mirror.ddram[i + len] != LCD_shadow.ddram[i + len])
+			len++;
+
+		record[0] = LCD_MIRROR_DELTA;
+		record[1] = i;
+		record[2] = len;
+		memcpy(&record[3], &LCD_shadow.ddram[i], len);
+
+		if(!LCD_MirrorSend(record, 3 + len))
+			break;
+
+		memcpy(&LCD_mirror.ddram[i], &LCD_shadow.ddram[i], len);
+		i += len - 1;
+	}
+
+	if(LCD_mirror.display_ctrl != LCD_shadow.display_ctrl ||
+			LCD_mirror.display_shift != LCD_shadow.display_shift)
+	{
+		record[0] = LCD_MIRROR_MODE;
+		record[1] = LCD_shadow.display_ctrl;
+		record[2] = LCD_shadow.display_shift;
+
+		if(LCD_MirrorSend(record, 3))
+		{
+			LCD_mirror.display_ctrl = LCD_shadow.display_ctrl;
+			LCD_mirror.display_shift = LCD_shadow.display_shift;
+		}
+	}
+
+	if(LCD_mirror.addr != LCD_shadow.addr && !LCD_shadow.addr_in_cgram)
+	{
+		record[0] = LCD_MIRROR_CURSOR;
+		record[1] = LCD_shadow.addr;
+
+		if(LCD_MirrorSend(record, 2))
+			LCD_mirror.addr = LCD_shadow.addr;
+	}
+
+	uint32_t flush_us = (LCD_DWT_CYCCNT - start) / LCD_CYCLES_PER_US;
+	if(flush_us > LCD_stats.mirror_flush_max_us)
+		LCD_stats.mirror_flush_max_us = flush_us;
+}
+
+uint8_t LCD_MirrorSend(const uint8_t* record, uint16_t len)
+{
+	static uint8_t frame_bytes[5 + LCD_DDRAM_SIZE];
+
+	//whole record or nothing, the host only sees complete records
+	if(LCD_mirror.credit < (1 + len) * configTICK_RATE_HZ)
+	{
+		LCD_stats.mirror_drops++;
+		return pdFALSE;
+	}
+
+	frame_bytes[0] = LCD_MIRROR_SYNC;
+	memcpy(&frame_bytes[1], record, len);
+
+	if(!LCD_MirrorTransmit(frame_bytes, 1 + len))
+	{
+		//host lost track of state somewhere, start it over from a snapshot
+		LCD_mirror.resync = pdTRUE;
+		LCD_stats.mirror_drops++;
+		return pdFALSE;
+	}
+
+	LCD_mirror.credit -= (1 + len) * configTICK_RATE_HZ;
+	LCD_stats.mirror_bytes += 1 + len;
+	LCD_stats.mirror_records++;
+
+	return pdTRUE;
+}
+
+__weak uint8_t LCD_MirrorTransmit(const uint8_t* data, uint16_t len)
+{
+	//override to mirror over a UART instead of RTT
+	return SEGGER_RTT_Write(LCD_MIRROR_RTT_CHANNEL, data, len) == len;
+}
+
+__weak uint8_t LCD_MirrorConnected(void)
+{
+	uint8_t request;
+
+	//host asks for a snapshot by sending any byte on the down channel
+	if(!SEGGER_RTT_HasData(LCD_MIRROR_RTT_CHANNEL))
+		return pdFALSE;
+
+	while(SEGGER_RTT_Read(LCD_MIRROR_RTT_CHANNEL, &request, 1) > 0);
+
+	return pdTRUE;
+}
+#endif
+
+void LCD_ScrubIdle(LCD_Mode_e LCD_mode)
+{
+	TickType_t now = xTaskGetTickCount();
+	uint8_t cells_checked = 0;
+
+	//budget accrues in cells * ticks so no fractions are needed
+	scrub_credit += (now - scrub_last_tick) * scrub_cells_per_sec;
+	scrub_last_tick = now;
+	if(scrub_credit > LCD_SCRUB_CELLS_PER_SLOT * configTICK_RATE_HZ)
+		scrub_credit = LCD_SCRUB_CELLS_PER_SLOT * configTICK_RATE_HZ;
+
+	//nothing can be read back through the SPI shift registers, and reading
+	//DDRAM would move the address counter out of CGRAM
+	if(LCD_mode == LCD_SPI || LCD_shadow.addr_in_cgram)
+		return;
+
+	//foreground updates always take priority over scrubbing
+	while(scrub_credit >= configTICK_RATE_HZ && uxQueueMessagesWaiting(LCD_write_queue) == 0)
+	{
+		scrub_credit -= configTICK_RATE_HZ;
+
+		uint8_t* unfixed = &scrub_unfixed[scrub_index / 8];
+		uint8_t bit = 1 << (scrub_index % 8);
+
+		if(!LCD_ScrubCell(LCD_mode, scrub_index))
+		{
+			//cell a reset did not fix is faulty, resetting again would not help
+			if(!(*unfixed & bit))
+			{
+				//recovery restores the address counter itself
+				LCD_RecoverController(LCD_mode);
+				LCD_stats.scrub_resets++;
+				*unfixed |= bit;
+				return;
+			}
+
+			LCD_stats.scrub_repair_failures++;
+		}
+		else
+			*unfixed &= ~bit;
+
+		scrub_index = (scrub_index + 1) % LCD_DDRAM_SIZE;
+		cells_checked++;
+	}
+
+	//reads moved the address counter away from where the application left it
+	if(cells_checked > 0)
+		LCD_WriteDirect(LCD_mode, LCD_REG_INSTRUCTION, LCD_CURSOR_SET | LCD_shadow.addr);
+}
+
+uint8_t LCD_ScrubCell(LCD_Mode_e LCD_mode, uint8_t index)
+{
+	uint8_t addr = index < LCD_LINE_LEN ? index : LCD_LINE2_ADDR + index - LCD_LINE_LEN;
+	uint8_t expected = LCD_shadow.ddram[index];
+
+	LCD_WriteDirect(LCD_mode, LCD_REG_INSTRUCTION, LCD_CURSOR_SET | addr);
+
+	//controller that did not take the address has most likely been reset
+	if((LCD_ReadPins(LCD_mode, LCD_REG_INSTRUCTION) & LCD_ADDR_MASK) != addr)
+		return pdFALSE;
+
+	LCD_stats.scrub_cells_checked++;
+
+	if(LCD_ReadPins(LCD_mode, LCD_REG_DATA) == expected)
+		return pdTRUE;
+
+	//rewrite only the corrupted cell, then make sure it stuck
+	LCD_WriteDirect(LCD_mode, LCD_REG_INSTRUCTION, LCD_CURSOR_SET | addr);
+	LCD_WriteDirect(LCD_mode, LCD_REG_DATA, expected);
+	LCD_WriteDirect(LCD_mode, LCD_REG_INSTRUCTION, LCD_CURSOR_SET | addr);
+
+	if(LCD_ReadPins(LCD_mode, LCD_REG_DATA) != expected)
+		return pdFALSE;
+
+	LCD_stats.scrub_cells_repaired++;
+
+	return pdTRUE;
+}
+
+void LCD_RecoverController(LCD_Mode_e LCD_mode)
+{
+	//same sequence as LCD_WriteInitSeq, written directly as the write task
+	//cannot wait on its own queue
+	lower_nibble_writable = pdFALSE;
+
+	HAL_Delay(10);
+	LCD_WritePins(LCD_mode, LCD_REG_INSTRUCTION, LCD_WRITE, LCD_FUNC_SET | LCD_8BIT_MODE);
+
+	HAL_Delay(10);
+	LCD_WritePins(LCD_mode, LCD_REG_INSTRUCTION, LCD_WRITE, LCD_FUNC_SET | LCD_8BIT_MODE);
+
+	HAL_Delay(1);
+	LCD_WritePins(LCD_mode, LCD_REG_INSTRUCTION, LCD_WRITE, LCD_FUNC_SET | LCD_8BIT_MODE);
+	LCD_SetExecWait(LCD_REG_INSTRUCTION, LCD_FUNC_SET);
+
+	if(LCD_mode == LCD_4BIT)
+	{
+		LCD_WriteDirect(LCD_mode, LCD_REG_INSTRUCTION, LCD_FUNC_SET | LCD_4BIT_MODE);
+		lower_nibble_writable = pdTRUE;
+	}
+
+	//bring controller back to what the shadow says it should hold
+	LCD_WriteDirect(LCD_mode, LCD_REG_INSTRUCTION, LCD_shadow.func_mode);
+	LCD_WriteDirect(LCD_mode, LCD_REG_INSTRUCTION, LCD_DISPLAY_CTRL | LCD_DISPLAY_OFF);
+	LCD_WriteDirect(LCD_mode, LCD_REG_INSTRUCTION, LCD_CLEAR);
+	LCD_WriteDirect(LCD_mode, LCD_REG_INSTRUCTION, LCD_ENTRY_MODE | LCD_AUTO_INCREMENT);
+
+	LCD_WriteDirect(LCD_mode, LCD_REG_INSTRUCTION, LCD_CGRAM_SET);
+	for(uint8_t i=0; i < LCD_CGRAM_SIZE; i++)
+		LCD_WriteDirect(LCD_mode, LCD_REG_DATA, LCD_shadow.cgram[i]);
+
+	//address counter wraps from end of line 1 to start of line 2 by itself
+	LCD_WriteDirect(LCD_mode, LCD_REG_INSTRUCTION, LCD_CURSOR_SET);
+	for(uint8_t i=0; i < LCD_DDRAM_SIZE; i++)
+		LCD_WriteDirect(LCD_mode, LCD_REG_DATA, LCD_shadow.ddram[i]);
+
+	for(uint8_t i=0; i < LCD_shadow.display_shift; i++)
+		LCD_WriteDirect(LCD_mode, LCD_REG_INSTRUCTION, LCD_SHIFT | LCD_SHIFT_DISPLAY | LCD_SHIFT_LEFT);
+
+	LCD_WriteDirect(LCD_mode, LCD_REG_INSTRUCTION, LCD_shadow.entry_mode);
+	LCD_WriteDirect(LCD_mode, LCD_REG_INSTRUCTION, LCD_shadow.display_ctrl);
+	LCD_WriteDirect(LCD_mode, LCD_REG_INSTRUCTION, LCD_shadow.addr_in_cgram ?
+			LCD_CGRAM_SET | LCD_shadow.addr : LCD_CURSOR_SET | LCD_shadow.addr);
+}
+
+void LCD_WriteTransaction(LCD_Mode_e LCD_mode, LCD_Transaction_t* txn)
+{
+	LCD_Frame_t frame;
+	uint8_t saved_addr = LCD_shadow.addr;
+	uint8_t saved_in_cgram = LCD_shadow.addr_in_cgram;
+	uint8_t nested_addr[LCD_TXN_MAX_DEPTH];
+	uint8_t nested_in_cgram[LCD_TXN_MAX_DEPTH];
+	uint8_t depth = 0;
+	//address counter is behind the shadow after cells have been skipped
+	uint8_t addr_behind = pdFALSE;
+
+	for(uint8_t i=0; i < txn->count; i++)
+	{
+		uint16_t txn_frame = txn->frames[i];
+
+		//nested transactions that restore the cursor are bracketed by markers
+		if(txn_frame & LCD_TXN_FRAME_SAVE)
+		{
+			nested_addr[depth] = LCD_shadow.addr;
+			nested_in_cgram[depth] = LCD_shadow.addr_in_cgram;
+			depth++;
+			continue;
+		}
+
+		frame.data = txn_frame & 0xFF;
+		frame.dest_reg = (txn_frame & LCD_TXN_FRAME_RS) ? LCD_REG_DATA : LCD_REG_INSTRUCTION;
+
+		if(txn_frame & LCD_TXN_FRAME_RESTORE)
+		{
+			depth--;
+			LCD_WriteAddr(LCD_mode, nested_addr[depth], nested_in_cgram[depth]);
+			addr_behind = pdFALSE;
+			continue;
+		}
+
+		//cell already holds the character, only the address moves on
+		if((txn_frame & LCD_TXN_FRAME_DIFF) && !LCD_shadow.addr_in_cgram &&
+				!(LCD_shadow.entry_mode & LCD_AUTO_SHIFT_DISPLAY) &&
+				LCD_shadow.ddram[LCD_ShadowIndex(LCD_shadow.addr)] == frame.data)
+		{
+			LCD_shadow.addr = LCD_NextAddr(LCD_shadow.addr, LCD_shadow.entry_mode & LCD_AUTO_INCREMENT);
+			addr_behind = pdTRUE;
+			continue;
+		}
+
+		//anything but a new address needs the address counter caught up first
+		if(addr_behind && (frame.dest_reg == LCD_REG_DATA ||
+				!(frame.data & (LCD_CURSOR_SET | LCD_CGRAM_SET))))
+			LCD_WriteAddr(LCD_mode, LCD_shadow.addr, pdFALSE);
+		addr_behind = pdFALSE;
+
+		if(txn_frame & LCD_TXN_FRAME_PAGE)
+			LCD_WritePageFlip(LCD_mode, frame.data);
+		else
+			LCD_WriteFrame(LCD_mode, &frame, pdTRUE);
+	}
+
+	//put the cursor back where the application left it
+	if(txn->restore_cursor)
+		LCD_WriteAddr(LCD_mode, saved_addr, saved_in_cgram);
+	else if(addr_behind)
+		LCD_WriteAddr(LCD_mode, LCD_shadow.addr, pdFALSE);
+
+	//hand transaction back to its owner
+	txn->pending = pdFALSE;
+}
+
+void LCD_DrainISRRings(LCD_Mode_e LCD_mode)
+{
+	uint8_t saved_addr = LCD_shadow.addr;
+	uint8_t saved_in_cgram = LCD_shadow.addr_in_cgram;
+	uint8_t drained = pdFALSE;
+
+	for(uint8_t i=0; i < LCD_ISR_SOURCES; i++)
+	{
+		LCD_ISRRing_t* ring = &LCD_isr_rings[i];
+		uint32_t head = ring->head;
+
+		//frames must be read only after the head that publishes them
+		__DMB();
+
+		while(ring->tail != head)
+		{
+			LCD_ISRSlot_t* slot = &ring->slots[ring->tail & (LCD_ISR_RING_SIZE - 1)];
+
+			LCD_WriteFrame(LCD_mode, &slot->frame, pdTRUE);
+
+			uint32_t latency = (LCD_DWT_CYCCNT - slot->post_time) / LCD_CYCLES_PER_US;
+			LCD_stats.isr_latency_last_us = latency;
+			if(latency > LCD_stats.isr_latency_max_us)
+				LCD_stats.isr_latency_max_us = latency;
+
+			//slot must be fully consumed before it is handed back to the ISR
+			__DMB();
+			ring->tail++;
+			drained = pdTRUE;
 		}
 	}
+
+	//ISR text must not move the cursor the application left behind
+	if(drained)
+		LCD_WriteAddr(LCD_mode, saved_addr, saved_in_cgram);
+}
+
+void LCD_WritePageFlip(LCD_Mode_e LCD_mode, uint8_t page)
+{
+	LCD_Frame_t frame;
+	uint8_t saved_ctrl = LCD_shadow.display_ctrl;
+
+	//each left shift moves the visible window one column further along,
+	//counted from where the display really is rather than where it was asked to be
+	uint8_t shifts = (page * LCD_COLUMNS + LCD_LINE_LEN - LCD_shadow.display_shift) % LCD_LINE_LEN;
+	uint8_t direction = LCD_SHIFT_LEFT;
+
+	if(shifts == 0)
+		return;
+
+	//shorter to go the other way round the circular DDRAM line
+	if(shifts > LCD_LINE_LEN / 2)
+	{
+		shifts = LCD_LINE_LEN - shifts;
+		direction = LCD_SHIFT_RIGHT;
+	}
+
+	//display is blanked while shifting so intermediate columns never show,
+	//then put back on (or left off) as it was
+	frame.dest_reg = LCD_REG_INSTRUCTION;
+	frame.data = saved_ctrl & ~LCD_DISPLAY_ON;
+	LCD_WriteFrame(LCD_mode, &frame, pdTRUE);
+
+	frame.data = LCD_SHIFT | LCD_SHIFT_DISPLAY | direction;
+	for(uint8_t i=0; i < shifts; i++)
+		LCD_WriteFrame(LCD_mode, &frame, pdTRUE);
+
+	frame.data = saved_ctrl;
+	LCD_WriteFrame(LCD_mode, &frame, pdTRUE);
+}
+
+void LCD_WriteAddr(LCD_Mode_e LCD_mode, uint8_t addr, uint8_t in_cgram)
+{
+	LCD_Frame_t frame;
+
+	frame.data = in_cgram ? LCD_CGRAM_SET | addr : LCD_CURSOR_SET | addr;
+	frame.dest_reg = LCD_REG_INSTRUCTION;
+	LCD_WriteFrame(LCD_mode, &frame, pdTRUE);
 }
 
 void LCD_WritePins(LCD_Mode_e LCD_mode, LCD_Register_e dest_reg, LCD_Operation_e operation, uint8_t data)
@@ -139,13 +816,13 @@ void LCD_8Bit_WritePins(LCD_Register_e dest_reg, LCD_Operation_e operation, uint
 	HAL_GPIO_WritePin(LCD_E_GPIO_Port, LCD_E_Pin, GPIO_PIN_SET);
 
 	//data setup time and enable pulse high width
-	HAL_Delay(1);
+	LCD_DelayUs(LCD_timing.enable_pulse_us);
 
 	//LCD is written on falling edge of enable
 	HAL_GPIO_WritePin(LCD_E_GPIO_Port, LCD_E_Pin, GPIO_PIN_RESET);
 
 	//data hold time and enable pulse low width
-	HAL_Delay(1);
+	LCD_DelayUs(LCD_timing.hold_us);
 }
 #endif
 
@@ -164,13 +841,13 @@ void LCD_4Bit_WritePins(LCD_Register_e dest_reg, LCD_Operation_e operation, uint
 	HAL_GPIO_WritePin(LCD_E_GPIO_Port, LCD_E_Pin, GPIO_PIN_SET);
 
 	//data setup time and enable pulse high width
-	HAL_Delay(1);
+	LCD_DelayUs(LCD_timing.enable_pulse_us);
 
 	//LCD is written on falling edge of enable
 	HAL_GPIO_WritePin(LCD_E_GPIO_Port, LCD_E_Pin, GPIO_PIN_RESET);
 
 	//data hold time and enable pulse low width
-	HAL_Delay(1);
+	LCD_DelayUs(LCD_timing.hold_us);
 }
 #endif
 
@@ -200,39 +877,274 @@ void LCD_SPI_WritePins(LCD_Register_e dest_reg, LCD_Operation_e operation, uint8
 	HAL_SPI_Transmit(&hspi2, frame_bytes, 1, HAL_MAX_DELAY);
 
 	//data setup time and enable pulse high width
-	HAL_Delay(1);
+	LCD_DelayUs(LCD_timing.enable_pulse_us);
 
 	//LCD is written on falling edge of enable
 	frame_bytes[0] = (0 << 7) | (operation << 6) | (dest_reg << 5);
 	HAL_SPI_Transmit(&hspi2, frame_bytes, 1, HAL_MAX_DELAY);
 
 	//data hold time and enable pulse low width
-	HAL_Delay(1);
+	LCD_DelayUs(LCD_timing.hold_us);
 
 	//unselect LCD and reset ICs by pullig chip select high
 	HAL_GPIO_WritePin(LCD_SPI_CS_GPIO_Port, LCD_SPI_CS_Pin, GPIO_PIN_SET);
 }
 #endif
 
-void LCD_WriteInitSeq(uint8_t use_4bit_mode)
+uint8_t LCD_Calibrate(LCD_Mode_e LCD_mode)
 {
-	//special init sequence required on power on
-	//wait 100 ms after power on
-	HAL_Delay(100);
-	LCD_SetFuncMode(LCD_8BIT_MODE, LCD_DONT_CARE, LCD_DONT_CARE);
+	//verification needs read back, which the SPI adapter cannot do
+	if(LCD_mode == LCD_SPI)
+		return pdFALSE;
 
-	//wait another 10 ms
-	HAL_Delay(10);
-	LCD_SetFuncMode(LCD_8BIT_MODE, LCD_DONT_CARE, LCD_DONT_CARE);
+	LCD_Timing_t safe = LCD_timing;
+	LCD_Timing_t tuned = LCD_timing;
+	uint32_t* params[] = {&LCD_timing.exec_us, &LCD_timing.clear_exec_us,
+			&LCD_timing.enable_pulse_us, &LCD_timing.hold_us};
+	uint32_t* tuned_params[] = {&tuned.exec_us, &tuned.clear_exec_us,
+			&tuned.enable_pulse_us, &tuned.hold_us};
 
-	//wait at least 200 us
-	HAL_Delay(1); //not ideal but shortest delay possible
-	LCD_SetFuncMode(LCD_8BIT_MODE, LCD_DONT_CARE, LCD_DONT_CARE);
+	//nothing to search down from if the current timing does not work
+	if(!LCD_CalibProbe(LCD_mode, pdTRUE))
+	{
+		LCD_RecoverController(LCD_mode);
+		return pdFALSE;
+	}
 
-	//busy flag is available once preceding data is written
-	xTaskNotifyGiveIndexed(LCD_write_task, 0);
-	//wait for queued data to be written
-	xTaskNotifyWait(0, 0, NULL, portMAX_DELAY);
+	//each parameter is searched with the others held at their safe values
+	for(uint8_t p=0; p < 4; p++)
+	{
+		uint32_t lo = 0;
+		uint32_t hi = *params[p];
+
+		//hi always passes, lo is the smallest value that still might
+		while(lo < hi)
+		{
+			uint32_t mid = (lo + hi) / 2;
+
+			*params[p] = mid;
+
+			if(LCD_CalibProbe(LCD_mode, p == 1))
+				hi = mid;
+			else
+			{
+				lo = mid + 1;
+
+				//a failed probe can leave the controller in any state
+				LCD_timing = safe;
+				LCD_RecoverController(LCD_mode);
+			}
+
+			LCD_timing = safe;
+		}
+
+		*tuned_params[p] = hi * (100 + LCD_CALIB_MARGIN_PCT) / 100 + 1;
+	}
+
+	//rewrites the screen disturbed by probing, using tuned timing throughout
+	LCD_timing = tuned;
+	LCD_RecoverController(LCD_mode);
+
+	if(!LCD_CalibProbe(LCD_mode, pdTRUE))
+	{
+		LCD_timing = safe;
+		LCD_RecoverController(LCD_mode);
+		return pdFALSE;
+	}
+
+	LCD_RecoverController(LCD_mode);
+	LCD_SaveTiming(&LCD_timing);
+
+	return pdTRUE;
+}
+
+void LCD_VerifyTiming(LCD_Mode_e LCD_mode)
+{
+	//stored timing cannot be checked without read back, so SPI has to trust it
+	if(!timing_unverified || LCD_mode == LCD_SPI)
+		return;
+
+	timing_unverified = pdFALSE;
+
+	//panel too slow for the stored timing falls back to the safe defaults
+	if(!LCD_CalibProbe(LCD_mode, pdTRUE))
+		LCD_timing = (LCD_Timing_t)LCD_DEFAULT_TIMING;
+
+	//rewrites the screen and shift disturbed by probing either way
+	LCD_RecoverController(LCD_mode);
+}
+
+uint8_t LCD_CalibProbe(LCD_Mode_e LCD_mode, uint8_t use_slow_instruction)
+{
+	static uint8_t seed;
+
+	for(uint8_t rep=0; rep < LCD_CALIB_REPEATS; rep++)
+	{
+		//fresh pattern each time so stale cells cannot pass
+		seed += 0x3B;
+
+		//write immediately after a slow instruction to exercise its wait
+		if(use_slow_instruction)
+			LCD_WriteDirect(LCD_mode, LCD_REG_INSTRUCTION, LCD_HOME);
+
+		LCD_WriteDirect(LCD_mode, LCD_REG_INSTRUCTION, LCD_CURSOR_SET | LCD_CALIB_ADDR);
+		for(uint8_t i=0; i < LCD_CALIB_CELLS; i++)
+			LCD_WriteDirect(LCD_mode, LCD_REG_DATA, seed + i * 0x55);
+
+		LCD_WriteDirect(LCD_mode, LCD_REG_INSTRUCTION, LCD_CURSOR_SET | LCD_CALIB_ADDR);
+		if((LCD_ReadPins(LCD_mode, LCD_REG_INSTRUCTION) & LCD_ADDR_MASK) != LCD_CALIB_ADDR)
+			return pdFALSE;
+
+		for(uint8_t i=0; i < LCD_CALIB_CELLS; i++)
+			if(LCD_ReadPins(LCD_mode, LCD_REG_DATA) != (uint8_t)(seed + i * 0x55))
+				return pdFALSE;
+	}
+
+	return pdTRUE;
+}
+
+uint8_t LCD_ReadPins(LCD_Mode_e LCD_mode, LCD_Register_e src_reg)
+{
+	uint8_t data = 0;
+
+	//previous write must be done before address or data can be read back
+	LCD_WaitExec();
+
+	switch(LCD_mode)
+	{
+	case LCD_4BIT:
+#ifdef LCD_4BIT_PINS_DEFINED
+		data = LCD_4Bit_ReadPins(src_reg) << 4;
+		data |= LCD_4Bit_ReadPins(src_reg);
+#else
+		configTHROW_EXCEPTION("error: 4-bit LCD pins not defined");
+#endif
+		break;
+	case LCD_8BIT:
+#ifdef LCD_8BIT_PINS_DEFINED
+		data = LCD_8Bit_ReadPins(src_reg);
+#else
+		configTHROW_EXCEPTION("error: 8-bit LCD pins not defined");
+#endif
+		break;
+	case LCD_SPI:
+		//shift registers only drive the LCD, nothing comes back
+		configTHROW_EXCEPTION("error: SPI LCD cannot be read");
+		break;
+	}
+
+	//reading data moves the address counter like a write does
+	if(src_reg == LCD_REG_DATA)
+		exec_wait_us = LCD_timing.exec_us;
+
+	return data;
+}
+
+#ifdef LCD_4BIT_PINS_DEFINED
+void LCD_SetDataPinsMode(uint8_t first_pin, uint32_t gpio_mode)
+{
+	GPIO_InitTypeDef GPIO_InitStruct = {0};
+
+	GPIO_InitStruct.Mode = gpio_mode;
+	GPIO_InitStruct.Pull = GPIO_NOPULL;
+	GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_LOW;
+
+	for(uint8_t i=first_pin; i<8; i++)
+	{
+		GPIO_InitStruct.Pin = LCD_DATA_GPIO_PINS[i];
+		HAL_GPIO_Init(LCD_DATA_GPIO_PORTS[i], &GPIO_InitStruct);
+	}
+}
+#endif
+
+#ifdef LCD_8BIT_PINS_DEFINED
+uint8_t LCD_8Bit_ReadPins(LCD_Register_e src_reg)
+{
+	uint8_t data = 0;
+
+	//release data pins before the LCD starts driving them
+	LCD_SetDataPinsMode(0, GPIO_MODE_INPUT);
+
+	//setup read/write and register select
+	HAL_GPIO_WritePin(LCD_RS_GPIO_Port, LCD_RS_Pin, src_reg);
+	HAL_GPIO_WritePin(LCD_RW_GPIO_Port, LCD_RW_Pin, LCD_READ);
+	//pulse enable high
+	HAL_GPIO_WritePin(LCD_E_GPIO_Port, LCD_E_Pin, GPIO_PIN_SET);
+
+	//data delay time and enable pulse high width
+	LCD_DelayUs(LCD_timing.enable_pulse_us);
+
+	//LCD drives data while enable is high
+	for(uint8_t i=0; i<8; i++)
+		data |= HAL_GPIO_ReadPin(LCD_DATA_GPIO_PORTS[i], LCD_DATA_GPIO_PINS[i]) << i;
+
+	HAL_GPIO_WritePin(LCD_E_GPIO_Port, LCD_E_Pin, GPIO_PIN_RESET);
+
+	//data hold time and enable pulse low width
+	LCD_DelayUs(LCD_timing.hold_us);
+
+	//LCD stops driving before data pins are outputs again
+	HAL_GPIO_WritePin(LCD_RW_GPIO_Port, LCD_RW_Pin, LCD_WRITE);
+	LCD_SetDataPinsMode(0, GPIO_MODE_OUTPUT_PP);
+
+	return data;
+}
+#endif
+
+#ifdef LCD_4BIT_PINS_DEFINED
+uint8_t LCD_4Bit_ReadPins(LCD_Register_e src_reg)
+{
+	//reads one nibble into lower nibble of result
+	uint8_t data = 0;
+
+	//release data pins before the LCD starts driving them
+	LCD_SetDataPinsMode(4, GPIO_MODE_INPUT);
+
+	//setup read/write and register select
+	HAL_GPIO_WritePin(LCD_RS_GPIO_Port, LCD_RS_Pin, src_reg);
+	HAL_GPIO_WritePin(LCD_RW_GPIO_Port, LCD_RW_Pin, LCD_READ);
+	//pulse enable high
+	HAL_GPIO_WritePin(LCD_E_GPIO_Port, LCD_E_Pin, GPIO_PIN_SET);
+
+	//data delay time and enable pulse high width
+	LCD_DelayUs(LCD_timing.enable_pulse_us);
+
+	//LCD drives data while enable is high
+	for(uint8_t i=4, j=0; i<8; i++, j++)
+		data |= HAL_GPIO_ReadPin(LCD_DATA_GPIO_PORTS[i], LCD_DATA_GPIO_PINS[i]) << j;
+
+	HAL_GPIO_WritePin(LCD_E_GPIO_Port, LCD_E_Pin, GPIO_PIN_RESET);
+
+	//data hold time and enable pulse low width
+	LCD_DelayUs(LCD_timing.hold_us);
+
+	//LCD stops driving before data pins are outputs again
+	HAL_GPIO_WritePin(LCD_RW_GPIO_Port, LCD_RW_Pin, LCD_WRITE);
+	LCD_SetDataPinsMode(4, GPIO_MODE_OUTPUT_PP);
+
+	return data;
+}
+#endif
+
+void LCD_WriteInitSeq(uint8_t use_4bit_mode)
+{
+	//special init sequence required on power on
+	//wait 100 ms after power on
+	HAL_Delay(100);
+	LCD_SetFuncMode(LCD_8BIT_MODE, LCD_DONT_CARE, LCD_DONT_CARE);
+
+	//wait another 10 ms
+	HAL_Delay(10);
+	LCD_SetFuncMode(LCD_8BIT_MODE, LCD_DONT_CARE, LCD_DONT_CARE);
+
+	//wait at least 200 us
+	HAL_Delay(1); //not ideal but shortest delay possible
+	LCD_SetFuncMode(LCD_8BIT_MODE, LCD_DONT_CARE, LCD_DONT_CARE);
+
+	//busy flag is available once preceding data is written
+	xTaskNotifyGiveIndexed(LCD_write_task, 0);
+	//wait for queued data to be written
+	xTaskNotifyWait(0, 0, NULL, portMAX_DELAY);
 
 	if(use_4bit_mode)
 	{
@@ -255,7 +1167,7 @@ void LCD_SetFuncMode(uint8_t data_length_flag, uint8_t line_num_flag, uint8_t fo
 	frame.data = LCD_FUNC_SET | data_length_flag | line_num_flag | font_type_flag;
 	frame.dest_reg = LCD_REG_INSTRUCTION;
 
-	xQueueSend(LCD_write_queue, &frame, portMAX_DELAY);
+	LCD_QueueFrame(&frame);
 }
 
 void LCD_SetEntryMode(uint8_t shift_dir_flag, uint8_t shift_mode_flag)
@@ -266,7 +1178,7 @@ void LCD_SetEntryMode(uint8_t shift_dir_flag, uint8_t shift_mode_flag)
 	frame.data = LCD_ENTRY_MODE | shift_dir_flag | shift_mode_flag;
 	frame.dest_reg = LCD_REG_INSTRUCTION;
 
-	xQueueSend(LCD_write_queue, &frame, portMAX_DELAY);
+	LCD_QueueFrame(&frame);
 }
 
 void LCD_TurnOnDisplay(void)
@@ -276,7 +1188,7 @@ void LCD_TurnOnDisplay(void)
 	frame.data = LCD_DISPLAY_CTRL | LCD_DISPLAY_ON | cursor_showing | cursor_blinking;
 	frame.dest_reg = LCD_REG_INSTRUCTION;
 
-	xQueueSend(LCD_write_queue, &frame, portMAX_DELAY);
+	LCD_QueueFrame(&frame);
 }
 
 void LCD_TurnOffDisplay(void)
@@ -286,7 +1198,7 @@ void LCD_TurnOffDisplay(void)
 	frame.data = LCD_DISPLAY_CTRL | LCD_DISPLAY_OFF | cursor_showing | cursor_blinking;
 	frame.dest_reg = LCD_REG_INSTRUCTION;
 
-	xQueueSend(LCD_write_queue, &frame, portMAX_DELAY);
+	LCD_QueueFrame(&frame);
 }
 
 void LCD_WriteText(const char* text)
@@ -298,7 +1210,7 @@ void LCD_WriteText(const char* text)
 	for(int i=0; i < strlen(text); i++)
 	{
 		frame.data = text[i];
-		xQueueSend(LCD_write_queue, &frame, portMAX_DELAY);
+		LCD_QueueFrame(&frame);
 	}
 }
 
@@ -309,7 +1221,13 @@ void LCD_ClearDisplay(void)
 	frame.data = LCD_CLEAR;
 	frame.dest_reg = LCD_REG_INSTRUCTION;
 
-	xQueueSend(LCD_write_queue, &frame, portMAX_DELAY);
+	xSemaphoreTake(page_lock, portMAX_DELAY);
+
+	//clear also removes display shift, every page and every animation
+	if(LCD_QueueFrame(&frame))
+		LCD_NotePageChange(0, pdTRUE);
+
+	xSemaphoreGive(page_lock);
 }
 
 void LCD_SetCursorMode(uint8_t show_cursor, uint8_t blink_cursor)
@@ -324,7 +1242,7 @@ void LCD_SetCursorMode(uint8_t show_cursor, uint8_t blink_cursor)
 			(blink_cursor ? LCD_CURSOR_BLINK_ON: LCD_CURSOR_BLINK_OFF);
 	frame.dest_reg = LCD_REG_INSTRUCTION;
 
-	xQueueSend(LCD_write_queue, &frame, portMAX_DELAY);
+	LCD_QueueFrame(&frame);
 }
 
 void LCD_SetCursorPos(uint8_t row, uint8_t column)
@@ -334,10 +1252,10 @@ void LCD_SetCursorPos(uint8_t row, uint8_t column)
 
 	LCD_Frame_t frame;
 
-	frame.data = LCD_CURSOR_SET | (column + row * 0x40);
+	frame.data = LCD_CURSOR_SET | LCD_VisibleAddr(LCD_CurrentPage(), row, column);
 	frame.dest_reg = LCD_REG_INSTRUCTION;
 
-	xQueueSend(LCD_write_queue, &frame, portMAX_DELAY);
+	LCD_QueueFrame(&frame);
 }
 
 void LCD_SetCursorHome(void)
@@ -347,5 +1265,946 @@ void LCD_SetCursorHome(void)
 	frame.data = LCD_HOME;
 	frame.dest_reg = LCD_REG_INSTRUCTION;
 
-	xQueueSend(LCD_write_queue, &frame, portMAX_DELAY);
+	xSemaphoreTake(page_lock, portMAX_DELAY);
+
+	//home also removes display shift
+	if(LCD_QueueFrame(&frame))
+		LCD_NotePageChange(0, pdFALSE);
+
+	xSemaphoreGive(page_lock);
+}
+
+uint8_t LCD_QueueFrame(const LCD_Frame_t* frame)
+{
+	LCD_Transaction_t* txn =
+			pvTaskGetThreadLocalStoragePointer(NULL, LCD_TXN_TLS_INDEX);
+
+	//calling task has a transaction open, collect frame instead of sending it
+	if(txn != NULL)
+	{
+		if(txn->count >= LCD_TXN_MAX_FRAMES)
+		{
+			txn->overflowed = pdTRUE;
+			return pdFALSE;
+		}
+
+		txn->frames[txn->count++] = frame->data |
+				(frame->dest_reg == LCD_REG_DATA ? LCD_TXN_FRAME_RS : 0);
+		return pdTRUE;
+	}
+
+	LCD_Command_t command;
+
+	command.type = LCD_CMD_FRAME;
+	command.frame = *frame;
+	command.post_time = LCD_DWT_CYCCNT;
+
+	return xQueueSend(LCD_write_queue, &command, portMAX_DELAY) == pdTRUE;
+}
+
+void LCD_BeginTransaction(LCD_Transaction_t* txn)
+{
+	txn->count = 0;
+	txn->overflowed = pdFALSE;
+	txn->restore_cursor = pdFALSE;
+	txn->page_after = LCD_PAGE_COUNT;
+	txn->clears = 0;
+	txn->outer = pvTaskGetThreadLocalStoragePointer(NULL, LCD_TXN_TLS_INDEX);
+	txn->depth = txn->outer != NULL ? txn->outer->depth + 1 : 0;
+
+	//writer only keeps cursors for so many levels of nesting
+	if(txn->depth > LCD_TXN_MAX_DEPTH)
+		txn->overflowed = pdTRUE;
+
+	vTaskSetThreadLocalStoragePointer(NULL, LCD_TXN_TLS_INDEX, txn);
+}
+
+uint8_t LCD_CommitTransaction(LCD_Transaction_t* txn)
+{
+	//txn is commonly on the caller's stack, so the writer must be done with it
+	return LCD_SendTransaction(txn, xTaskGetCurrentTaskHandle(), portMAX_DELAY);
+}
+
+uint8_t LCD_SendTransaction(LCD_Transaction_t* txn, TaskHandle_t requester, TickType_t ticks_to_wait)
+{
+	LCD_Transaction_t* outer = txn->outer;
+
+	vTaskSetThreadLocalStoragePointer(NULL, LCD_TXN_TLS_INDEX, outer);
+
+	//a nested transaction that cannot be written takes the outer one with it
+	if(txn->overflowed)
+	{
+		if(outer != NULL)
+			outer->overflowed = pdTRUE;
+		return pdFALSE;
+	}
+
+	if(txn->count == 0)
+		return pdTRUE;
+
+	//nested transaction becomes part of the one it was begun in
+	if(outer != NULL)
+	{
+		uint8_t markers = txn->restore_cursor ? 2 : 0;
+
+		if(outer->count + txn->count + markers > LCD_TXN_MAX_FRAMES)
+		{
+			outer->overflowed = pdTRUE;
+			return pdFALSE;
+		}
+
+		if(txn->restore_cursor)
+			outer->frames[outer->count++] = LCD_TXN_FRAME_SAVE;
+		memcpy(&outer->frames[outer->count], txn->frames, txn->count * sizeof(txn->frames[0]));
+		outer->count += txn->count;
+		if(txn->restore_cursor)
+			outer->frames[outer->count++] = LCD_TXN_FRAME_RESTORE;
+
+		if(txn->page_after != LCD_PAGE_COUNT)
+			outer->page_after = txn->page_after;
+		outer->clears += txn->clears;
+
+		return pdTRUE;
+	}
+
+	LCD_Command_t command;
+
+	command.type = LCD_CMD_TXN;
+	command.txn = txn;
+	command.requester = requester;
+	command.post_time = LCD_DWT_CYCCNT;
+	txn->pending = pdTRUE;
+
+	//whole transaction is published to the writer in one step
+	if(xQueueSend(LCD_write_queue, &command, ticks_to_wait) != pdTRUE)
+	{
+		txn->pending = pdFALSE;
+		return pdFALSE;
+	}
+
+	//writer notifies once every frame has been written
+	if(requester != NULL)
+		LCD_AwaitWriter();
+
+	//page and clears only change once their frames are on the way
+	if(txn->page_after != LCD_PAGE_COUNT)
+		visible_page = txn->page_after;
+	display_clears += txn->clears;
+
+	return pdTRUE;
+}
+
+LCD_ISRSlot_t* LCD_ReserveFromISR(uint8_t isr_source, uint32_t count)
+{
+	if(isr_source >= LCD_ISR_SOURCES)
+		return NULL;
+
+	LCD_ISRRing_t* ring = &LCD_isr_rings[isr_source];
+
+	//whole post is dropped rather than letting it be split up by an overflow
+	if(count > LCD_ISR_RING_SIZE - (ring->head - ring->tail))
+	{
+		ring->overflows++;
+		return NULL;
+	}
+
+	return ring->slots;
+}
+
+void LCD_PublishFromISR(uint8_t isr_source, uint32_t count)
+{
+	LCD_ISRRing_t* ring = &LCD_isr_rings[isr_source];
+
+	//frames must be visible to the writer before the head that publishes them
+	__DMB();
+	ring->head += count;
+	ring->posts++;
+}
+
+uint8_t LCD_WriteTextFromISR(uint8_t isr_source, const char* text)
+{
+	uint32_t count = strlen(text);
+	uint32_t post_time = LCD_DWT_CYCCNT;
+	LCD_ISRSlot_t* slots = LCD_ReserveFromISR(isr_source, count);
+
+	if(slots == NULL)
+		return pdFALSE;
+
+	uint32_t head = LCD_isr_rings[isr_source].head;
+
+	for(uint32_t i=0; i < count; i++)
+	{
+		LCD_ISRSlot_t* slot = &slots[(head + i) & (LCD_ISR_RING_SIZE - 1)];
+		slot->frame.data = text[i];
+		slot->frame.dest_reg = LCD_REG_DATA;
+		slot->post_time = post_time;
+	}
+
+	LCD_PublishFromISR(isr_source, count);
+
+	return pdTRUE;
+}
+
+uint8_t LCD_SetCursorPosFromISR(uint8_t isr_source, uint8_t row, uint8_t column)
+{
+	if(row > 1) row = 1;
+	if(column > 15) column = 15;
+
+	uint32_t post_time = LCD_DWT_CYCCNT;
+	LCD_ISRSlot_t* slots = LCD_ReserveFromISR(isr_source, 1);
+
+	if(slots == NULL)
+		return pdFALSE;
+
+	LCD_ISRSlot_t* slot = &slots[LCD_isr_rings[isr_source].head & (LCD_ISR_RING_SIZE - 1)];
+	//task local transactions cannot be looked at from an ISR
+	slot->frame.data = LCD_CURSOR_SET | LCD_VisibleAddr(visible_page, row, column);
+	slot->frame.dest_reg = LCD_REG_INSTRUCTION;
+	slot->post_time = post_time;
+
+	LCD_PublishFromISR(isr_source, 1);
+
+	return pdTRUE;
+}
+
+uint8_t LCD_CalibrateTiming(void)
+{
+	LCD_Command_t command;
+
+	command.type = LCD_CMD_CALIBRATE;
+	command.requester = xTaskGetCurrentTaskHandle();
+
+	xQueueSend(LCD_write_queue, &command, portMAX_DELAY);
+
+	//write task owns the pins for the whole search
+	return LCD_AwaitWriter();
+}
+
+void LCD_GetTiming(LCD_Timing_t* timing)
+{
+	taskENTER_CRITICAL();
+	*timing = LCD_timing;
+	taskEXIT_CRITICAL();
+}
+
+void LCD_SetTiming(const LCD_Timing_t* timing)
+{
+	taskENTER_CRITICAL();
+	LCD_timing = *timing;
+	taskEXIT_CRITICAL();
+}
+
+__weak uint8_t LCD_LoadTiming(LCD_Timing_t* timing)
+{
+	//default keeps timing in backup SRAM, which survives reset and, with
+	//VBAT supplied, power off
+	LCD_StoredTiming_t* stored = LCD_EnableTimingStore();
+
+	if(stored->magic != LCD_TIMING_MAGIC ||
+			stored->checksum != LCD_TimingChecksum(&stored->timing))
+		return pdFALSE;
+
+	*timing = stored->timing;
+
+	return pdTRUE;
+}
+
+__weak void LCD_SaveTiming(const LCD_Timing_t* timing)
+{
+	LCD_StoredTiming_t* stored = LCD_EnableTimingStore();
+
+	stored->timing = *timing;
+	stored->checksum = LCD_TimingChecksum(timing);
+	stored->magic = LCD_TIMING_MAGIC;
+}
+
+LCD_StoredTiming_t* LCD_EnableTimingStore(void)
+{
+	__HAL_RCC_PWR_CLK_ENABLE();
+	HAL_PWR_EnableBkUpAccess();
+	__HAL_RCC_BKPSRAM_CLK_ENABLE();
+
+	return (LCD_StoredTiming_t*)(BKPSRAM_BASE + LCD_TIMING_BKPSRAM_OFFSET);
+}
+
+uint32_t LCD_TimingChecksum(const LCD_Timing_t* timing)
+{
+	return LCD_TIMING_MAGIC ^ timing->enable_pulse_us ^ (timing->hold_us << 8) ^
+			(timing->exec_us << 16) ^ (timing->clear_exec_us << 4);
+}
+
+void LCD_SetScrubBudget(uint16_t cells_per_sec)
+{
+	scrub_cells_per_sec = cells_per_sec;
+}
+
+void LCD_GetStats(LCD_Stats_t* stats)
+{
+	*stats = LCD_stats;
+
+	stats->isr_posts = stats->isr_overflows = 0;
+	for(uint8_t i=0; i < LCD_ISR_SOURCES; i++)
+	{
+		stats->isr_posts += LCD_isr_rings[i].posts;
+		stats->isr_overflows += LCD_isr_rings[i].overflows;
+	}
+}
+
+void LCD_ConsoleClear(void)
+{
+	memset(LCD_console.screen, ' ', sizeof(LCD_console.screen));
+	LCD_console.row = LCD_console.column = 0;
+	LCD_console.esc_state = LCD_ESC_NONE;
+	LCD_console.active = pdTRUE;
+
+	LCD_ClearDisplay();
+	LCD_console.clears_seen = display_clears;
+}
+
+void LCD_ConsoleWrite(const char* text)
+{
+	char screen[LCD_ROWS][LCD_COLUMNS];
+	char run[LCD_COLUMNS + 1];
+
+	//console has to know what is on the display before it can diff against it
+	if(!LCD_console.active)
+		LCD_ConsoleClear();
+
+	//a clear from outside the console blanked the display and homed the cursor
+	if(LCD_console.clears_seen != display_clears)
+	{
+		memset(LCD_console.screen, ' ', sizeof(LCD_console.screen));
+		LCD_console.row = LCD_console.column = 0;
+		LCD_console.clears_seen = display_clears;
+	}
+
+	uint8_t saved_row = LCD_console.row;
+	uint8_t saved_column = LCD_console.column;
+
+	memcpy(screen, LCD_console.screen, sizeof(screen));
+
+	while(*text)
+		LCD_ConsolePutChar(screen, *text++);
+
+	LCD_BeginTransaction(&LCD_console.txn);
+
+	//only runs of cells that differ from what is displayed are written
+	for(uint8_t row=0; row < LCD_ROWS; row++)
+	{
+		for(uint8_t col=0; col < LCD_COLUMNS; col++)
+		{
+			if(screen[row][col] == LCD_console.screen[row][col])
+				continue;
+
+			uint8_t len = 0;
+			while(col + len < LCD_COLUMNS && screen[row][col + len] != LCD_console.screen[row][col + len])
+			{
+				run[len] = screen[row][col + len];
+				len++;
+			}
+			run[len] = '\0';
+
+			LCD_SetCursorPos(row, col);
+			LCD_WriteText(run);
+			col += len;
+		}
+	}
+
+	LCD_SetCursorPos(LCD_console.row, LCD_console.column);
+
+	//nothing was written, the display still shows the old image
+	if(!LCD_CommitTransaction(&LCD_console.txn))
+	{
+		LCD_console.row = saved_row;
+		LCD_console.column = saved_column;
+		return;
+	}
+
+	memcpy(LCD_console.screen, screen, sizeof(screen));
+}
+
+void LCD_ConsolePutChar(char screen[LCD_ROWS][LCD_COLUMNS], char c)
+{
+	if(LCD_console.esc_state != LCD_ESC_NONE)
+	{
+		LCD_ConsoleEscape(screen, c);
+		return;
+	}
+
+	switch(c)
+	{
+	case '\n':
+		LCD_ConsoleNewLine(screen);
+		break;
+	case '\r':
+		LCD_console.column = 0;
+		break;
+	case '\b':
+		if(LCD_console.column > 0)
+			LCD_console.column--;
+		break;
+	case '\t':
+		do
+			LCD_ConsolePutChar(screen, ' ');
+		while(LCD_console.column % LCD_CONSOLE_TAB != 0 && LCD_console.column < LCD_COLUMNS);
+		break;
+	case '\f':
+		memset(screen, ' ', LCD_ROWS * LCD_COLUMNS);
+		LCD_console.row = LCD_console.column = 0;
+		break;
+	case LCD_CONSOLE_ESC:
+		LCD_console.esc_state = LCD_ESC_START;
+		break;
+	default:
+		//other control characters would show up as garbage glyphs
+		if((uint8_t)c < ' ')
+			break;
+
+		//wrapping is deferred so a full line followed by \n does not scroll twice
+		if(LCD_console.column >= LCD_COLUMNS)
+			LCD_ConsoleNewLine(screen);
+
+		screen[LCD_console.row][LCD_console.column++] = c;
+		break;
+	}
+}
+
+void LCD_ConsoleNewLine(char screen[LCD_ROWS][LCD_COLUMNS])
+{
+	LCD_console.column = 0;
+
+	if(LCD_console.row < LCD_ROWS - 1)
+	{
+		LCD_console.row++;
+		return;
+	}
+
+	//scroll up, only the cells that end up different get rewritten
+	memmove(screen[0], screen[1], (LCD_ROWS - 1) * LCD_COLUMNS);
+	memset(screen[LCD_ROWS - 1], ' ', LCD_COLUMNS);
+}
+
+void LCD_ConsoleEscape(char screen[LCD_ROWS][LCD_COLUMNS], char c)
+{
+	if(LCD_console.esc_state == LCD_ESC_START)
+	{
+		//only CSI sequences are supported, anything else is dropped
+		LCD_console.esc_state = c == '[' ? LCD_ESC_CSI : LCD_ESC_NONE;
+		LCD_console.esc_param_count = 0;
+		memset(LCD_console.esc_params, 0, sizeof(LCD_console.esc_params));
+		return;
+	}
+
+	if(c >= '0' && c <= '9')
+	{
+		uint8_t i = LCD_console.esc_param_count;
+		if(i < LCD_CONSOLE_MAX_PARAMS)
+			LCD_console.esc_params[i] = LCD_console.esc_params[i] * 10 + (c - '0');
+		return;
+	}
+
+	if(c == ';')
+	{
+		LCD_console.esc_param_count++;
+		return;
+	}
+
+	LCD_console.esc_state = LCD_ESC_NONE;
+
+	switch(c)
+	{
+	case 'H':
+		//parameters are 1-based, missing or 0 means the first row or column
+		LCD_console.row = LCD_console.esc_params[0] ? LCD_console.esc_params[0] - 1 : 0;
+		LCD_console.column = LCD_console.esc_params[1] ? LCD_console.esc_params[1] - 1 : 0;
+		if(LCD_console.row > LCD_ROWS - 1) LCD_console.row = LCD_ROWS - 1;
+		if(LCD_console.column > LCD_COLUMNS - 1) LCD_console.column = LCD_COLUMNS - 1;
+		break;
+	case 'K':
+		if(LCD_console.column < LCD_COLUMNS)
+			memset(&screen[LCD_console.row][LCD_console.column], ' ',
+					LCD_COLUMNS - LCD_console.column);
+		break;
+	case 'J':
+		if(LCD_console.esc_params[0] == 2)
+			memset(screen, ' ', LCD_ROWS * LCD_COLUMNS);
+		break;
+	}
+}
+
+uint8_t LCD_VisibleAddr(uint8_t page, uint8_t row, uint8_t column)
+{
+	//columns are relative to the page shown
+	return row * LCD_LINE2_ADDR + (page * LCD_COLUMNS + column) % LCD_LINE_LEN;
+}
+
+uint8_t LCD_CurrentPage(void)
+{
+	//page changed earlier in the calling task's open transactions takes effect
+	//before anything after it in them
+	for(LCD_Transaction_t* txn = pvTaskGetThreadLocalStoragePointer(NULL, LCD_TXN_TLS_INDEX);
+			txn != NULL; txn = txn->outer)
+		if(txn->page_after != LCD_PAGE_COUNT)
+			return txn->page_after;
+
+	return visible_page;
+}
+
+uint8_t LCD_WritePage(uint8_t page, const char* line1, const char* line2)
+{
+	const char* lines[LCD_ROWS] = {line1, line2};
+	LCD_Frame_t frame;
+	uint8_t written;
+
+	if(page >= LCD_PAGE_COUNT)
+		return pdFALSE;
+
+	xSemaphoreTake(page_lock, portMAX_DELAY);
+	LCD_BeginTransaction(&page_txn);
+
+	for(uint8_t row=0; row < LCD_ROWS; row++)
+	{
+		//pages live at fixed DDRAM columns whether shown or not
+		frame.data = LCD_CURSOR_SET | (row * LCD_LINE2_ADDR + page * LCD_COLUMNS);
+		frame.dest_reg = LCD_REG_INSTRUCTION;
+		LCD_QueueFrame(&frame);
+
+		//lines shorter than the display are padded out with spaces
+		frame.dest_reg = LCD_REG_DATA;
+		size_t len = strlen(lines[row]);
+		for(uint8_t col=0; col < LCD_COLUMNS; col++)
+		{
+			frame.data = col < len ? lines[row][col] : ' ';
+			LCD_QueueFrame(&frame);
+		}
+	}
+
+	//writer compares against what DDRAM actually holds and skips matching
+	//cells, so rewriting a page only costs the cells that changed
+	for(uint8_t i=0; i < page_txn.count; i++)
+		if(page_txn.frames[i] & LCD_TXN_FRAME_RS)
+			page_txn.frames[i] |= LCD_TXN_FRAME_DIFF;
+
+	//writing a hidden page must not move the cursor on the visible one
+	page_txn.restore_cursor = pdTRUE;
+
+	written = LCD_CommitTransaction(&page_txn);
+	xSemaphoreGive(page_lock);
+
+	return written;
+}
+
+uint8_t LCD_ShowPage(uint8_t page)
+{
+	uint8_t written;
+
+	if(page >= LCD_PAGE_COUNT)
+		return pdFALSE;
+
+	xSemaphoreTake(page_lock, portMAX_DELAY);
+
+	//already shown, flipping would only blink the display
+	if(page == LCD_CurrentPage())
+	{
+		xSemaphoreGive(page_lock);
+		return pdTRUE;
+	}
+
+	//shift count is worked out by the writer, no data is written
+	LCD_BeginTransaction(&page_txn);
+	page_txn.frames[page_txn.count++] = LCD_TXN_FRAME_PAGE | page;
+	LCD_NotePageChange(page, pdFALSE);
+	written = LCD_CommitTransaction(&page_txn);
+
+	xSemaphoreGive(page_lock);
+
+	return written;
+}
+
+void LCD_NotePageChange(uint8_t page, uint8_t cleared)
+{
+	LCD_Transaction_t* txn =
+			pvTaskGetThreadLocalStoragePointer(NULL, LCD_TXN_TLS_INDEX);
+
+	//frames went into an open transaction, which only counts once committed
+	if(txn != NULL)
+	{
+		txn->page_after = page;
+		txn->clears += cleared;
+		return;
+	}
+
+	visible_page = page;
+	display_clears += cleared;
+}
+
+uint8_t LCD_AddAnimation(LCD_Animation_t* anim)
+{
+	uint8_t width = anim->type == LCD_ANIM_SPINNER ? 1 : anim->width;
+
+	if(width > LCD_ANIM_MAX_WIDTH || anim->column + width > LCD_COLUMNS ||
+			anim->row >= LCD_ROWS || anim->page >= LCD_PAGE_COUNT)
+		return pdFALSE;
+
+	//spinners and blinking fields need something to show and a period that
+	//is at least one tick, otherwise every phase would be the first
+	if(anim->type != LCD_ANIM_PROGRESS && (anim->text == NULL || anim->text[0] == '\0' ||
+			pdMS_TO_TICKS(anim->period_ms) == 0))
+		return pdFALSE;
+
+	if(LCD_anim_timer == NULL)
+	{
+		LCD_anim_timer = xTimerCreate("LCD Anim", pdMS_TO_TICKS(LCD_ANIM_TICK_MS),
+				pdTRUE, NULL, LCD_AnimTick);
+		xTimerStart(LCD_anim_timer, portMAX_DELAY);
+	}
+
+	anim->register_pending = pdTRUE;
+
+	//table is changed on the timer task so a tick never sees it half updated
+	xTimerPendFunctionCall(LCD_AnimRegister, anim, pdTRUE, portMAX_DELAY);
+
+	while(anim->register_pending)
+		vTaskDelay(1);
+
+	//table was full
+	return anim->registered;
+}
+
+void LCD_RemoveAnimation(LCD_Animation_t* anim)
+{
+	anim->register_pending = pdTRUE;
+
+	xTimerPendFunctionCall(LCD_AnimRegister, anim, pdFALSE, portMAX_DELAY);
+
+	//no tick can be using anim once this returns
+	while(anim->register_pending)
+		vTaskDelay(1);
+}
+
+void LCD_SetProgress(LCD_Animation_t* anim, uint16_t value)
+{
+	//drawn on the next tick
+	anim->value = value > anim->max ? anim->max : value;
+}
+
+void LCD_AnimRegister(void* anim, uint32_t add)
+{
+	LCD_Animation_t* request = anim;
+
+	for(uint8_t i=0; i < LCD_MAX_ANIMATIONS; i++)
+	{
+		if(add && LCD_animations[i] == NULL)
+		{
+			LCD_animations[i] = request;
+			request->registered = pdTRUE;
+			break;
+		}
+
+		if(!add && LCD_animations[i] == request)
+		{
+			LCD_animations[i] = NULL;
+			request->registered = pdFALSE;
+			break;
+		}
+	}
+
+	//a full table leaves registered clear, either way the caller is released
+	request->register_pending = pdFALSE;
+}
+
+void LCD_AnimTick(TimerHandle_t timer)
+{
+	TickType_t now = xTaskGetTickCount();
+	uint8_t cells[LCD_ANIM_MAX_WIDTH];
+	uint8_t loading_glyphs = pdFALSE;
+	LCD_Frame_t frame;
+
+	//nothing animated can be seen
+	if(!(LCD_shadow.display_ctrl & LCD_DISPLAY_ON))
+		return;
+
+	//timer task must never block, a writer still busy with the previous
+	//tick just means this one is skipped
+	if(anim_txn.pending)
+		return;
+
+	LCD_BeginTransaction(&anim_txn);
+
+	//glyphs go ahead of any cell that uses them, while the transaction is empty
+	for(uint8_t i=0; i < LCD_MAX_ANIMATIONS && !anim_glyphs_loaded; i++)
+	{
+		if(LCD_animations[i] != NULL && LCD_animations[i]->type == LCD_ANIM_PROGRESS)
+		{
+			LCD_AnimLoadGlyphs();
+			loading_glyphs = pdTRUE;
+			break;
+		}
+	}
+
+	//every cell is sent each tick and the writer skips those DDRAM already
+	//holds, so whatever overwrote an animation is repaired on the next tick
+	for(uint8_t n=0; n < LCD_MAX_ANIMATIONS; n++)
+	{
+		uint8_t i = (anim_first + n) % LCD_MAX_ANIMATIONS;
+		LCD_Animation_t* anim = LCD_animations[i];
+
+		if(anim == NULL || anim->page != visible_page)
+			continue;
+
+		uint8_t width = anim->type == LCD_ANIM_SPINNER ? 1 : anim->width;
+
+		//rest wait for the next tick, which starts with them so none starves,
+		//keeping room for the cursor to be restored
+		if(anim_txn.count + 1 + width > LCD_TXN_MAX_FRAMES - 1)
+		{
+			anim_first = i;
+			break;
+		}
+
+		LCD_AnimRender(anim, now, cells);
+
+		frame.data = LCD_CURSOR_SET | (anim->row * LCD_LINE2_ADDR +
+				(anim->page * LCD_COLUMNS + anim->column) % LCD_LINE_LEN);
+		frame.dest_reg = LCD_REG_INSTRUCTION;
+		LCD_QueueFrame(&frame);
+
+		frame.dest_reg = LCD_REG_DATA;
+		for(uint8_t col=0; col < width; col++)
+		{
+			frame.data = cells[col];
+			LCD_QueueFrame(&frame);
+			anim_txn.frames[anim_txn.count - 1] |= LCD_TXN_FRAME_DIFF;
+		}
+	}
+
+	//animations must not move the application's cursor
+	anim_txn.restore_cursor = pdTRUE;
+
+	//queue full, the next tick sends every cell again anyway
+	if(LCD_SendTransaction(&anim_txn, NULL, 0) && loading_glyphs)
+		anim_glyphs_loaded = pdTRUE;
+}
+
+void LCD_AnimRender(LCD_Animation_t* anim, TickType_t now, uint8_t* cells)
+{
+	TickType_t period = pdMS_TO_TICKS(anim->period_ms);
+	uint32_t phase = period ? now / period : 0;
+
+	switch(anim->type)
+	{
+	case LCD_ANIM_PROGRESS:
+	{
+		//each cell fills one pixel column at a time
+		uint32_t filled = anim->max ? (uint32_t)anim->value * anim->width * LCD_GLYPH_COLUMNS / anim->max : 0;
+
+		for(uint8_t i=0; i < anim->width; i++)
+		{
+			uint32_t cell_filled = filled < LCD_GLYPH_COLUMNS ? filled : LCD_GLYPH_COLUMNS;
+			filled -= cell_filled;
+
+			if(cell_filled == LCD_GLYPH_COLUMNS)
+				cells[i] = LCD_FULL_BLOCK;
+			else if(cell_filled > 0)
+				cells[i] = LCD_ANIM_GLYPH_BASE + cell_filled - 1;
+			else
+				cells[i] = ' ';
+		}
+		break;
+	}
+	case LCD_ANIM_SPINNER:
+	{
+		size_t frames = strlen(anim->text);
+		cells[0] = frames ? anim->text[phase % frames] : ' ';
+		break;
+	}
+	case LCD_ANIM_BLINK:
+	{
+		//text shorter than the field is padded, nothing past its end is read
+		uint8_t done = pdFALSE;
+
+		for(uint8_t i=0; i < anim->width; i++)
+		{
+			if(anim->text[i] == '\0')
+				done = pdTRUE;
+
+			//blanked on odd phases
+			cells[i] = (phase & 1) || done ? ' ' : anim->text[i];
+		}
+		break;
+	}
+	}
+}
+
+void LCD_AnimLoadGlyphs(void)
+{
+	LCD_Frame_t frame;
+
+	//goes in the same transaction ahead of the cells that use the glyphs
+	frame.data = LCD_CGRAM_SET | (LCD_ANIM_GLYPH_BASE * LCD_GLYPH_ROWS);
+	frame.dest_reg = LCD_REG_INSTRUCTION;
+	LCD_QueueFrame(&frame);
+
+	frame.dest_reg = LCD_REG_DATA;
+	for(uint8_t columns=1; columns < LCD_GLYPH_COLUMNS; columns++)
+	{
+		//leftmost pixel columns filled, last row left for the cursor
+		for(uint8_t row=0; row < LCD_GLYPH_ROWS; row++)
+		{
+			frame.data = row < LCD_GLYPH_ROWS - 1 ?
+					(0x1F << (LCD_GLYPH_COLUMNS - columns)) & 0x1F : 0;
+			LCD_QueueFrame(&frame);
+		}
+	}
+}
+
+#if LCD_USE_CAPTURE
+void LCD_StartCapture(uint8_t* buf, uint32_t size)
+{
+	static uint8_t up_buffer[LCD_CAPTURE_RTT_BUF_SIZE];
+	uint8_t header[LCD_CAPTURE_HEADER_SIZE] = {'L', 'C', 'D', 'C', LCD_CAPTURE_VERSION};
+
+	if(buf == NULL)
+		SEGGER_RTT_ConfigUpBuffer(LCD_CAPTURE_RTT_CHANNEL, "LCD Capture",
+				up_buffer, sizeof(up_buffer), SEGGER_RTT_MODE_NO_BLOCK_SKIP);
+
+	header[5] = LCD_capture.mode;
+
+	LCD_capture.buf = buf;
+	LCD_capture.size = size;
+	LCD_capture.len = 0;
+	LCD_capture.dropped = 0;
+	LCD_capture.last_time = LCD_DWT_CYCCNT;
+
+	LCD_CaptureWrite(header, sizeof(header));
+
+	//frames already queued are recorded too
+	LCD_capture.active = pdTRUE;
+}
+
+uint32_t LCD_StopCapture(void)
+{
+	LCD_capture.active = pdFALSE;
+
+	//writer may be part way through recording a frame
+	LCD_WaitForWriter(NULL);
+
+	return LCD_capture.len;
+}
+
+void LCD_CaptureFrame(const LCD_Frame_t* frame)
+{
+	uint32_t now = LCD_DWT_CYCCNT;
+	uint32_t delta_us = (now - LCD_capture.last_time) / LCD_CYCLES_PER_US;
+	uint8_t record[LCD_CAPTURE_RECORD_SIZE];
+
+	//drop the fraction of a microsecond that was not recorded into the next gap
+	LCD_capture.last_time = now - (now - LCD_capture.last_time) % LCD_CYCLES_PER_US;
+
+	if(delta_us > 0xFFFF)
+		delta_us = 0xFFFF;
+
+	record[0] = delta_us & 0xFF;
+	record[1] = delta_us >> 8;
+	record[2] = frame->dest_reg == LCD_REG_DATA ? LCD_CAPTURE_FLAG_DATA : 0;
+	record[3] = frame->data;
+
+	LCD_CaptureWrite(record, sizeof(record));
+}
+
+void LCD_CaptureWrite(const uint8_t* bytes, uint32_t len)
+{
+	if(LCD_capture.buf == NULL)
+	{
+		if(SEGGER_RTT_Write(LCD_CAPTURE_RTT_CHANNEL, bytes, len) != len)
+			LCD_capture.dropped++;
+		return;
+	}
+
+	//log is left ending on the last whole record that fit
+	if(LCD_capture.len + len > LCD_capture.size)
+	{
+		LCD_capture.dropped++;
+		return;
+	}
+
+	memcpy(&LCD_capture.buf[LCD_capture.len], bytes, len);
+	LCD_capture.len += len;
+}
+#endif
+
+uint32_t LCD_WaitForWriter(uint32_t* latency_max_us)
+{
+	LCD_Command_t command;
+
+	command.type = LCD_CMD_SYNC;
+	command.requester = xTaskGetCurrentTaskHandle();
+	command.latency_max_us = latency_max_us;
+
+	xQueueSend(LCD_write_queue, &command, portMAX_DELAY);
+
+	//latency_max_us is written before the reply, so it must not go out of scope first
+	return LCD_AwaitWriter();
+}
+
+uint32_t LCD_AwaitWriter(void)
+{
+	uint32_t reply;
+
+	xTaskNotifyWaitIndexed(LCD_REPLY_NOTIFY_INDEX, 0, 0, &reply, portMAX_DELAY);
+
+	return reply;
+}
+
+uint8_t LCD_ReplayCapture(const uint8_t* log, uint32_t len, uint8_t timed, LCD_ReplayReport_t* report)
+{
+	LCD_Frame_t frame;
+	uint32_t start;
+
+	if(len < LCD_CAPTURE_HEADER_SIZE || memcmp(log, "LCDC", 4) != 0 ||
+			log[4] != LCD_CAPTURE_VERSION)
+		return pdFALSE;
+
+	memset(report, 0, sizeof(*report));
+
+	//latency is only reported for frames of this replay, and earlier traffic
+	//must not count towards its time either
+	start = LCD_WaitForWriter(NULL);
+
+	for(uint32_t i=LCD_CAPTURE_HEADER_SIZE; i + LCD_CAPTURE_RECORD_SIZE <= len; i += LCD_CAPTURE_RECORD_SIZE)
+	{
+		uint32_t delta_us = log[i] | (log[i + 1] << 8);
+
+		//gaps shorter than a tick are covered by the writer's own waits
+		if(timed && delta_us >= 1000000 / configTICK_RATE_HZ)
+			vTaskDelay(pdMS_TO_TICKS(delta_us / 1000));
+
+		frame.dest_reg = (log[i + 2] & LCD_CAPTURE_FLAG_DATA) ? LCD_REG_DATA : LCD_REG_INSTRUCTION;
+		frame.data = log[i + 3];
+
+		LCD_QueueFrame(&frame);
+		report->frames++;
+	}
+
+	//time is taken by the writer so the wake up of this task is not counted
+	report->elapsed_us = (LCD_WaitForWriter(&report->latency_max_us) - start) / LCD_CYCLES_PER_US;
+	report->frames_per_sec = report->elapsed_us ?
+			(uint64_t)report->frames * 1000000 / report->elapsed_us : 0;
+	LCD_GetScreen(report->screen[0], report->screen[1]);
+
+	return pdTRUE;
+}
+
+void LCD_GetScreen(char* line1, char* line2)
+{
+	char* lines[LCD_ROWS] = {line1, line2};
+
+	//read as the writer last left it, may be mid update if frames are queued
+	for(uint8_t row=0; row < LCD_ROWS; row++)
+	{
+		for(uint8_t col=0; col < LCD_COLUMNS; col++)
+			lines[row][col] = LCD_shadow.ddram[row * LCD_LINE_LEN +
+					(LCD_shadow.display_shift + col) % LCD_LINE_LEN];
+		lines[row][LCD_COLUMNS] = '\0';
+	}
 }
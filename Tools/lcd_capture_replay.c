@@ -0,0 +1,258 @@
+/*lcd_capture_replay.c*/
+
+/*Replays frame logs recorded by LCD_StartCapture through a model of the
+HD44780 and reports how the traffic was written and what ended up on the
+display. Given two logs, e.g. before and after a driver change, it also
+checks both leave the controller in the same state and exits with 1 if not.
+
+	cc -o lcd_capture_replay Tools/lcd_capture_replay.c
+	./lcd_capture_replay before.bin after.bin
+
+RAM logs can be dumped with the debugger, e.g. "dump binary memory",
+streamed logs with JLinkRTTLogger on LCD_CAPTURE_RTT_CHANNEL.*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/*must match lcd_controller_private.h*/
+#define LCD_CLEAR		0x1
+#define LCD_HOME		0x2
+#define LCD_ENTRY_MODE		0x4
+#define LCD_DISPLAY_CTRL	0x8
+#define LCD_SHIFT		0x10
+#define LCD_FUNC_SET		0x20
+#define LCD_CGRAM_SET		0x40
+#define LCD_CURSOR_SET		0x80
+#define LCD_AUTO_INCREMENT	0x2
+#define LCD_AUTO_SHIFT_DISPLAY 	0x1
+#define LCD_DISPLAY_ON		0x4
+#define LCD_SHIFT_DISPLAY	0x8
+#define LCD_SHIFT_RIGHT		0x4
+#define LCD_ADDR_MASK		0x7F
+
+#define LCD_LINE_LEN		40
+#define LCD_LINE2_ADDR		0x40
+#define LCD_DDRAM_SIZE		(2 * LCD_LINE_LEN)
+#define LCD_CGRAM_SIZE		64
+#define LCD_ROWS		2
+#define LCD_COLUMNS		16
+
+#define LCD_CAPTURE_VERSION	1
+#define LCD_CAPTURE_HEADER_SIZE	8
+#define LCD_CAPTURE_RECORD_SIZE	4
+#define LCD_CAPTURE_FLAG_DATA	0x1
+
+#define MAX_LOG_SIZE		(16 * 1024 * 1024)
+
+typedef struct
+{
+	uint8_t ddram[LCD_DDRAM_SIZE];
+	uint8_t cgram[LCD_CGRAM_SIZE];
+	uint8_t addr;
+	uint8_t addr_in_cgram;
+	uint8_t entry_mode;
+	uint8_t display_ctrl;
+	uint8_t display_shift;
+} Model_t;
+
+typedef struct
+{
+	unsigned long frames;
+	unsigned long data_frames;
+	unsigned long long span_us;
+	unsigned long max_gap_us;
+	Model_t model;
+} Replay_t;
+
+static uint8_t log_buf[MAX_LOG_SIZE];
+
+uint8_t NextAddr(uint8_t addr, uint8_t increment)
+{
+	//address counter wraps between the end of one line and start of the other
+	if(increment)
+	{
+		if(addr == LCD_LINE_LEN - 1)
+			return LCD_LINE2_ADDR;
+		if(addr == LCD_LINE2_ADDR + LCD_LINE_LEN - 1)
+			return 0;
+		return addr + 1;
+	}
+
+	if(addr == 0)
+		return LCD_LINE2_ADDR + LCD_LINE_LEN - 1;
+	if(addr == LCD_LINE2_ADDR)
+		return LCD_LINE_LEN - 1;
+	return addr - 1;
+}
+
+void ModelApply(Model_t* m, uint8_t is_data, uint8_t data)
+{
+	uint8_t increment = m->entry_mode & LCD_AUTO_INCREMENT;
+
+	if(is_data)
+	{
+		if(m->addr_in_cgram)
+		{
+			m->cgram[m->addr] = data;
+			m->addr = (m->addr + (increment ? 1 : -1)) & (LCD_CGRAM_SIZE - 1);
+			return;
+		}
+
+		m->ddram[((m->addr & LCD_LINE2_ADDR) ? LCD_LINE_LEN : 0) + (m->addr & 0x3F) % LCD_LINE_LEN] = data;
+		m->addr = NextAddr(m->addr, increment);
+
+		if(m->entry_mode & LCD_AUTO_SHIFT_DISPLAY)
+			m->display_shift = (m->display_shift + (increment ? 1 : LCD_LINE_LEN - 1)) % LCD_LINE_LEN;
+		return;
+	}
+
+	//highest set bit identifies the instruction
+	if(data & LCD_CURSOR_SET)
+	{
+		m->addr = data & LCD_ADDR_MASK;
+		m->addr_in_cgram = 0;
+	}
+	else if(data & LCD_CGRAM_SET)
+	{
+		m->addr = data & (LCD_CGRAM_SIZE - 1);
+		m->addr_in_cgram = 1;
+	}
+	else if(data & LCD_FUNC_SET)
+		;
+	else if(data & LCD_SHIFT)
+	{
+		if(data & LCD_SHIFT_DISPLAY)
+			m->display_shift = (m->display_shift +
+					((data & LCD_SHIFT_RIGHT) ? LCD_LINE_LEN - 1 : 1)) % LCD_LINE_LEN;
+		else
+			m->addr = NextAddr(m->addr, data & LCD_SHIFT_RIGHT);
+	}
+	else if(data & LCD_DISPLAY_CTRL)
+		m->display_ctrl = data;
+	else if(data & LCD_ENTRY_MODE)
+		m->entry_mode = data;
+	else if(data & (LCD_HOME | LCD_CLEAR))
+	{
+		if(data & LCD_CLEAR)
+		{
+			memset(m->ddram, ' ', sizeof(m->ddram));
+			m->entry_mode |= LCD_AUTO_INCREMENT;
+		}
+
+		m->addr = 0;
+		m->addr_in_cgram = 0;
+		m->display_shift = 0;
+	}
+}
+
+int Replay(const char* path, Replay_t* r)
+{
+	FILE* f = fopen(path, "rb");
+	size_t len;
+
+	if(f == NULL)
+	{
+		perror(path);
+		return 0;
+	}
+
+	len = fread(log_buf, 1, sizeof(log_buf), f);
+	fclose(f);
+
+	if(len < LCD_CAPTURE_HEADER_SIZE || memcmp(log_buf, "LCDC", 4) != 0 ||
+			log_buf[4] != LCD_CAPTURE_VERSION)
+	{
+		fprintf(stderr, "%s: not a version %d LCD capture\n", path, LCD_CAPTURE_VERSION);
+		return 0;
+	}
+
+	//capture normally starts after init, so assume the state init leaves
+	memset(r, 0, sizeof(*r));
+	memset(r->model.ddram, ' ', sizeof(r->model.ddram));
+	r->model.entry_mode = LCD_ENTRY_MODE | LCD_AUTO_INCREMENT;
+	r->model.display_ctrl = LCD_DISPLAY_CTRL | LCD_DISPLAY_ON;
+
+	for(size_t i=LCD_CAPTURE_HEADER_SIZE; i + LCD_CAPTURE_RECORD_SIZE <= len; i += LCD_CAPTURE_RECORD_SIZE)
+	{
+		unsigned long gap_us = log_buf[i] | (log_buf[i + 1] << 8);
+		uint8_t is_data = log_buf[i + 2] & LCD_CAPTURE_FLAG_DATA;
+
+		//first gap is from starting the capture, not from a frame
+		if(r->frames > 0)
+		{
+			r->span_us += gap_us;
+			if(gap_us > r->max_gap_us)
+				r->max_gap_us = gap_us;
+		}
+
+		r->frames++;
+		r->data_frames += is_data != 0;
+
+		ModelApply(&r->model, is_data, log_buf[i + 3]);
+	}
+
+	return 1;
+}
+
+void Report(const char* path, const Replay_t* r)
+{
+	printf("%s\n", path);
+	printf("  frames      %lu (%lu data, %lu instruction)\n", r->frames,
+			r->data_frames, r->frames - r->data_frames);
+	printf("  span        %llu us\n", r->span_us);
+	printf("  throughput  %llu frames/s\n", r->span_us ? r->frames * 1000000ULL / r->span_us : 0);
+	printf("  mean gap    %llu us, max gap %lu us\n",
+			r->frames > 1 ? r->span_us / (r->frames - 1) : 0, r->max_gap_us);
+	printf("  display     %s, shift %u, cursor 0x%02X\n",
+			(r->model.display_ctrl & LCD_DISPLAY_ON) ? "on" : "off",
+			r->model.display_shift, r->model.addr);
+
+	for(int row=0; row < LCD_ROWS; row++)
+	{
+		printf("  |");
+		for(int col=0; col < LCD_COLUMNS; col++)
+		{
+			uint8_t c = r->model.ddram[row * LCD_LINE_LEN + (r->model.display_shift + col) % LCD_LINE_LEN];
+			//custom and extended glyphs have no terminal equivalent
+			putchar(c < 0x20 || c > 0x7E ? '#' : c);
+		}
+		printf("|\n");
+	}
+}
+
+int main(int argc, char** argv)
+{
+	static Replay_t replays[2];
+
+	if(argc < 2 || argc > 3)
+	{
+		fprintf(stderr, "usage: %s capture.bin [other.bin]\n", argv[0]);
+		return 2;
+	}
+
+	for(int i=0; i < argc - 1; i++)
+	{
+		if(!Replay(argv[i + 1], &replays[i]))
+			return 2;
+		Report(argv[i + 1], &replays[i]);
+	}
+
+	if(argc == 2)
+		return 0;
+
+	const Model_t* a = &replays[0].model;
+	const Model_t* b = &replays[1].model;
+
+	//hidden DDRAM holds pages, so all of it has to match, not just what is shown
+	int same = memcmp(a->ddram, b->ddram, sizeof(a->ddram)) == 0 &&
+			memcmp(a->cgram, b->cgram, sizeof(a->cgram)) == 0 &&
+			a->display_ctrl == b->display_ctrl && a->display_shift == b->display_shift &&
+			a->addr == b->addr && a->addr_in_cgram == b->addr_in_cgram;
+
+	printf("output      %s\n", same ? "identical" : "DIFFERENT");
+	printf("frames      %ld\n", (long)replays[1].frames - (long)replays[0].frames);
+	printf("span        %lld us\n", (long long)replays[1].span_us - (long long)replays[0].span_us);
+
+	return same ? 0 : 1;
+}
@@ -0,0 +1,154 @@
+/*lcd_mirror_view.c*/
+
+/*Renders the 16x2 display mirrored by the LCD controller when it is built
+with LCD_USE_MIRROR set to 1. Records are read from a file or stdin, e.g.
+
+	cc -o lcd_mirror_view Tools/lcd_mirror_view.c
+	JLinkRTTLogger -Device STM32F446RE -If SWD -Speed 4000 -RTTChannel 2 /dev/stdout | ./lcd_mirror_view
+
+or from a UART when LCD_MirrorTransmit has been overridden to use one
+
+	./lcd_mirror_view /dev/ttyACM0
+
+Nothing is shown until the first snapshot arrives, which is sent on reset,
+every LCD_MIRROR_SNAPSHOT_MS, and whenever the host writes a byte to the
+RTT down channel.*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/*must match lcd_controller_private.h*/
+#define LCD_LINE_LEN		40
+#define LCD_LINE2_ADDR		0x40
+#define LCD_DDRAM_SIZE		(2 * LCD_LINE_LEN)
+#define LCD_DISPLAY_ON		0x4
+#define LCD_CURSOR_ON		0x2
+
+#define LCD_MIRROR_SYNC		0xA5
+#define LCD_MIRROR_SNAPSHOT	'S'
+#define LCD_MIRROR_DELTA	'D'
+#define LCD_MIRROR_CURSOR	'C'
+#define LCD_MIRROR_MODE		'M'
+
+#define LCD_ROWS		2
+#define LCD_COLUMNS		16
+
+typedef struct
+{
+	uint8_t ddram[LCD_DDRAM_SIZE];
+	uint8_t addr;
+	uint8_t display_ctrl;
+	uint8_t display_shift;
+	uint8_t synced;
+} Mirror_t;
+
+int ReadByte(FILE* in)
+{
+	return fgetc(in);
+}
+
+int ReadBytes(FILE* in, uint8_t* buf, size_t len)
+{
+	return fread(buf, 1, len, in) == len;
+}
+
+void Render(const Mirror_t* mirror, unsigned long records)
+{
+	//cursor address as a visible row and column
+	int cursor_row = (mirror->addr & LCD_LINE2_ADDR) ? 1 : 0;
+	int cursor_col = ((mirror->addr & 0x3F) % LCD_LINE_LEN + LCD_LINE_LEN -
+			mirror->display_shift) % LCD_LINE_LEN;
+
+	printf("\x1b[H\x1b[2J+----------------+\n");
+
+	for(int row=0; row < LCD_ROWS; row++)
+	{
+		putchar('|');
+
+		for(int col=0; col < LCD_COLUMNS; col++)
+		{
+			uint8_t c = mirror->ddram[row * LCD_LINE_LEN + (mirror->display_shift + col) % LCD_LINE_LEN];
+			int show_cursor = (mirror->display_ctrl & LCD_CURSOR_ON) &&
+					row == cursor_row && col == cursor_col;
+
+			if(!(mirror->display_ctrl & LCD_DISPLAY_ON))
+				c = ' ';
+			//custom and extended glyphs have no terminal equivalent
+			else if(c < 0x20 || c > 0x7E)
+				c = '#';
+
+			printf(show_cursor ? "\x1b[7m%c\x1b[0m" : "%c", c);
+		}
+
+		printf("|\n");
+	}
+
+	printf("+----------------+\n");
+	printf("shift %2u  addr 0x%02X  %s  records %lu\n", mirror->display_shift, mirror->addr,
+			(mirror->display_ctrl & LCD_DISPLAY_ON) ? "on " : "off", records);
+	fflush(stdout);
+}
+
+int main(int argc, char** argv)
+{
+	FILE* in = stdin;
+	Mirror_t mirror;
+	unsigned long records = 0;
+	uint8_t buf[3 + LCD_DDRAM_SIZE];
+	int c;
+
+	if(argc > 1 && (in = fopen(argv[1], "rb")) == NULL)
+	{
+		perror(argv[1]);
+		return 1;
+	}
+
+	memset(&mirror, 0, sizeof(mirror));
+
+	while((c = ReadByte(in)) != EOF)
+	{
+		//anything between records is skipped until the next sync byte
+		if(c != LCD_MIRROR_SYNC)
+			continue;
+
+		switch(ReadByte(in))
+		{
+		case LCD_MIRROR_SNAPSHOT:
+			if(!ReadBytes(in, buf, 3 + LCD_DDRAM_SIZE))
+				return 0;
+			mirror.addr = buf[0];
+			mirror.display_ctrl = buf[1];
+			mirror.display_shift = buf[2] % LCD_LINE_LEN;
+			memcpy(mirror.ddram, &buf[3], LCD_DDRAM_SIZE);
+			mirror.synced = 1;
+			break;
+		case LCD_MIRROR_DELTA:
+			if(!ReadBytes(in, buf, 2) || buf[0] + buf[1] > LCD_DDRAM_SIZE)
+				continue;
+			if(!ReadBytes(in, &mirror.ddram[buf[0]], buf[1]))
+				return 0;
+			break;
+		case LCD_MIRROR_CURSOR:
+			if(!ReadBytes(in, buf, 1))
+				return 0;
+			mirror.addr = buf[0];
+			break;
+		case LCD_MIRROR_MODE:
+			if(!ReadBytes(in, buf, 2))
+				return 0;
+			mirror.display_ctrl = buf[0];
+			mirror.display_shift = buf[1] % LCD_LINE_LEN;
+			break;
+		default:
+			continue;
+		}
+
+		records++;
+
+		if(mirror.synced)
+			Render(&mirror, records);
+	}
+
+	return 0;
+}